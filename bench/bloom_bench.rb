@@ -0,0 +1,249 @@
+# Measure ns/op of the hot paths across filter sizes, key lengths, hash
+# engines and layouts, with Ruby's Set and Hash for comparison.
+#
+#   rake bench:baseline             # before a change: record the baseline
+#   rake bench                      # or: ruby -Ilib bench/bloom_bench.rb
+#
+# Results are written as JSON to bench/results.json and compared against
+# bench/baseline.json. Timings only compare on the machine that took them,
+# so the baseline isn't committed: record one with rake bench:baseline (or
+# BENCH_SAVE_BASELINE=1) before a change and run rake bench after it.
+# Environment:
+#
+#   BENCH_QUICK=1          fewer keys and sizes, for a smoke test
+#   BENCH_KEYS=n           keys per measurement (default 100000)
+#   BENCH_MAX_SIZE=bytes   largest bit array (default 512 MB)
+#   BENCH_OUTPUT=path      where to write the results
+#   BENCH_BASELINE=path    baseline to compare against
+#   BENCH_SAVE_BASELINE=1  write the results as the new baseline
+#   BENCH_TOLERANCE=0.25   fail if any result is this much slower than the
+#                          baseline (by default differences are only shown)
+require 'json'
+require 'set'
+require 'time'
+require 'objspace'
+require 'filter_bloom/version'
+require 'filter_bloom/filter_impl'
+
+module BloomBench
+  DIR = File.expand_path(__dir__)
+  QUICK = ENV['BENCH_QUICK'] == '1'
+  NKEYS = (ENV['BENCH_KEYS'] || (QUICK ? 20_000 : 100_000)).to_i
+  MAX_SIZE = (ENV['BENCH_MAX_SIZE'] || 512 << 20).to_i
+  REPS = QUICK ? 2 : 3
+
+  # From well inside L1 to far beyond the last level cache
+  SIZES = [16 << 10, 256 << 10, 8 << 20, 128 << 20, 512 << 20, 2 << 30]
+    .select { |s| s <= MAX_SIZE }
+    .then { |s| QUICK ? s.first(3) : s }
+  KEY_LENGTHS = [8, 32, 128]
+  ENGINES = %i[murmur3 wyhash siphash]
+  LAYOUTS = %i[standard blocked]
+  DEFAULT_KEY_LENGTH = 16
+  # The optimal number for a 1% false positive rate; kept fixed so that
+  # every size does the same work per item
+  HASHES = 7
+  # Tenants checked per key by the bank comparison, each a filter of
+  # BANK_CAPACITY items
+  BANK_SLOTS = QUICK ? [1000] : [1000, 10_000]
+  BANK_CAPACITY = 1000
+  BANK_KEYS = QUICK ? 200 : 1000
+
+  module_function
+
+  # n distinct keys of len bytes; prefix is one character
+  def keys(n, len, prefix)
+    Array.new(n) { |i| format("%s%0#{len - 1}d", prefix, i) }
+  end
+
+  def clock
+    Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+  end
+
+  # Best of REPS runs, in ns per item
+  def measure(nops)
+    best = nil
+    REPS.times do
+      t = clock
+      yield
+      t = clock - t
+      best = t if best.nil? || t < best
+    end
+    (best.to_f / nops).round(2)
+  end
+
+  # Fault in the whole bit array, so the first timed pass doesn't pay for
+  # the kernel zeroing pages
+  def filter(size, **opts)
+    f = BloomFilter.new(NKEYS, memory: size, hashes: HASHES, **opts)
+    f.merge!(f.dup)
+    f
+  end
+
+  def filter_ops(results, name, f, hit, miss, **config)
+    nkeys = hit.size
+    entry = ->(op, ns) { results << config.merge(name: "#{op}/#{name}", op: op, ns_per_op: ns) }
+
+    entry.(:add, measure(nkeys) { hit.each { |k| f << k } })
+    entry.(:query_hit, measure(nkeys) { hit.each { |k| f.include?(k) } })
+    entry.(:query_miss, measure(nkeys) { miss.each { |k| f.include?(k) } })
+    entry.(:add_all, measure(nkeys) { f.add_all(hit) })
+    entry.(:query_all, measure(nkeys) { f.query_all(miss) })
+  end
+
+  def run
+    results = []
+    hit = keys(NKEYS, DEFAULT_KEY_LENGTH, 'h')
+    miss = keys(NKEYS, DEFAULT_KEY_LENGTH, 'm')
+
+    SIZES.each do |size|
+      LAYOUTS.each do |layout|
+        f = filter(size, layout: layout)
+        filter_ops(results, "#{layout}/murmur3/#{DEFAULT_KEY_LENGTH}B/#{size}",
+                   f, hit, miss, layout: layout, engine: :murmur3,
+                   key_length: DEFAULT_KEY_LENGTH, size: size)
+        f = nil
+        GC.start
+      end
+    end
+
+    size = 8 << 20
+    ENGINES.each do |engine|
+      KEY_LENGTHS.each do |len|
+        h = keys(NKEYS, len, 'h')
+        m = keys(NKEYS, len, 'm')
+        f = filter([size, MAX_SIZE].min, hash: engine)
+        filter_ops(results, "standard/#{engine}/#{len}B/#{f.size}", f, h, m,
+                   layout: :standard, engine: engine, key_length: len, size: f.size)
+
+        opts = engine == :siphash ? { hash: engine, hash_key: f.hash_key } : { hash: engine }
+        ns = measure(NKEYS) { h.each { |k| BloomFilter.hash_values(k, 3, **opts) } }
+        results << { name: "hash_values/#{engine}/#{len}B", op: :hash_values,
+                     engine: engine, key_length: len, ns_per_op: ns }
+      end
+    end
+
+    results.concat(bank_ops(hit))
+    results.concat(ruby_baselines(hit, miss))
+    results
+  end
+
+  # One key against many small filters: a loop over BloomFilter objects, the
+  # same loop with the key hashed once into a BloomFilter::Digest, and a
+  # BloomFilter::Bank holding the same filters. ns/op is per key.
+  def bank_ops(hit)
+    keys = hit.first(BANK_KEYS)
+    BANK_SLOTS.flat_map do |nslots|
+      filters = Array.new(nslots) { |i| BloomFilter.new(BANK_CAPACITY, fpr: 0.01) }
+      bank = BloomFilter::Bank.new(nslots, BANK_CAPACITY, fpr: 0.01)
+      filters.each_with_index do |f, i|
+        f.add_all(hit.sample(BANK_CAPACITY / 2, random: Random.new(i)))
+        bank[i] = f
+      end
+
+      loop_ns = measure(keys.size) { keys.each { |k| filters.select { |f| f.include?(k) } } }
+      digest_ns = measure(keys.size) do
+        keys.each { |k| d = BloomFilter.digest(k); filters.select { |f| f.include?(d) } }
+      end
+      bank_ns = measure(keys.size) { keys.each { |k| bank.query(k) } }
+      [[:filter_loop, loop_ns], [:digest_loop, digest_ns], [:bank_query, bank_ns]].map do |op, ns|
+        { name: "bank/#{op}/#{nslots}", op: op, slots: nslots, ns_per_op: ns }
+      end
+    end
+  end
+
+  # Set and Hash holding the same keys, for speed and memory per item. Their
+  # memory includes the frozen copies of the keys they keep; a filter keeps
+  # none.
+  def ruby_baselines(hit, miss)
+    nkeys = hit.size
+    filter = BloomFilter.new(nkeys, fpr: 0.01)
+    structures = {
+      bloom_filter: [filter, ->(k) { filter << k }, ->(k) { filter.include?(k) }],
+      set: [set = Set.new, ->(k) { set << k }, ->(k) { set.include?(k) }],
+      hash: [hash = {}, ->(k) { hash[k] = true }, ->(k) { hash.key?(k) }]
+    }
+
+    structures.flat_map do |kind, (obj, add, query)|
+      results = [
+        [:add, measure(nkeys) { hit.each(&add) }],
+        [:query_hit, measure(nkeys) { hit.each(&query) }],
+        [:query_miss, measure(nkeys) { miss.each(&query) }]
+      ].map do |op, ns|
+        { name: "baseline/#{kind}/#{op}", op: op, structure: kind, ns_per_op: ns }
+      end
+
+      if kind == :bloom_filter
+        bytes = obj.size
+      else
+        table = kind == :set && obj.instance_variable_defined?(:@hash) ? obj.instance_variable_get(:@hash) : obj
+        bytes = ObjectSpace.memsize_of(obj) + (table.equal?(obj) ? 0 : ObjectSpace.memsize_of(table))
+        bytes += table.each_key.sum { |k| ObjectSpace.memsize_of(k) }
+      end
+      results << { name: "baseline/#{kind}/bytes_per_item", op: :memory, structure: kind,
+                   bytes_per_item: (bytes.to_f / nkeys).round(2) }
+    end
+  end
+
+  # Print how each result compares with the baseline; returns the results
+  # that are slower by more than the tolerance.
+  def compare(results, baseline, tolerance)
+    old = baseline['results'].to_h { |r| [r['name'], r['ns_per_op']] }
+    regressions = []
+
+    puts format('%-48s %10s %10s %8s', 'benchmark', 'ns/op', 'baseline', 'change')
+    results.each do |r|
+      next unless r[:ns_per_op]
+      was = old[r[:name]]
+      change = was && was > 0 ? r[:ns_per_op] / was - 1 : nil
+      puts format('%-48s %10.2f %10s %8s', r[:name], r[:ns_per_op],
+                  was ? format('%.2f', was) : '-', change ? format('%+.1f%%', change * 100) : '-')
+      regressions << r if tolerance && change && change > tolerance
+    end
+    regressions
+  end
+
+  def main
+    results = run
+    report = {
+      meta: {
+        version: BloomFilter::Version,
+        ruby: RUBY_DESCRIPTION,
+        keys: NKEYS,
+        quick: QUICK,
+        time: Time.now.utc.iso8601
+      },
+      results: results
+    }
+
+    output = ENV['BENCH_OUTPUT'] || File.join(DIR, 'results.json')
+    File.write(output, JSON.pretty_generate(report) + "\n")
+    puts "wrote #{output}"
+
+    baseline_path = ENV['BENCH_BASELINE'] || File.join(DIR, 'baseline.json')
+    if ENV['BENCH_SAVE_BASELINE'] == '1'
+      File.write(baseline_path, JSON.pretty_generate(report) + "\n")
+      puts "saved baseline #{baseline_path}"
+    end
+
+    results.select { |r| r[:bytes_per_item] }.each do |r|
+      puts format('%-48s %10.2f bytes/item', r[:name], r[:bytes_per_item])
+    end
+
+    unless File.exist?(baseline_path)
+      puts "no baseline at #{baseline_path}, so nothing to compare with;"
+      puts "record one on this machine with: rake bench:baseline"
+      return
+    end
+
+    tolerance = ENV['BENCH_TOLERANCE'] && ENV['BENCH_TOLERANCE'].to_f
+    regressions = compare(results, JSON.parse(File.read(baseline_path)), tolerance)
+    return if regressions.empty?
+
+    warn "#{regressions.size} result(s) slower than the baseline by more than #{(tolerance * 100).round}%:"
+    regressions.each { |r| warn "  #{r[:name]}" }
+    exit 1
+  end
+end
+
+BloomBench.main if $0 == __FILE__
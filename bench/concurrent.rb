@@ -0,0 +1,34 @@
+# Compare threads adding to one filter created with concurrent: true against
+# the same threads taking turns on a plain filter behind a Mutex.
+#
+#   ruby -Ilib bench/concurrent.rb [threads] [keys per thread]
+require 'benchmark'
+require 'filter_bloom/filter_impl'
+
+threads = (ARGV[0] || 4).to_i
+per_thread = (ARGV[1] || 1_000_000).to_i
+keys = Array.new(threads) { |t| Array.new(per_thread) { |i| "key-#{t}-#{i}" } }
+BloomFilter.nogvl_threshold = 0
+
+def run(keys)
+  keys.map { |k| Thread.new { yield k } }.each(&:join)
+end
+
+Benchmark.bm(20) do |x|
+  [:standard, :blocked].each do |layout|
+    filter = BloomFilter.new(threads * per_thread, fpr: 0.01, layout: layout)
+    lock = Mutex.new
+    x.report("#{layout} mutex") do
+      run(keys) { |k| lock.synchronize { filter.add_all(k) } }
+    end
+
+    concurrent = BloomFilter.new(threads * per_thread, fpr: 0.01, layout: layout,
+                                 concurrent: true)
+    x.report("#{layout} concurrent") do
+      run(keys) { |k| concurrent.add_all(k) }
+    end
+
+    missing = keys.flatten.count { |k| !concurrent.include?(k) }
+    abort "#{missing} keys missing from the concurrent filter" if missing > 0
+  end
+end
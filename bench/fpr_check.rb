@@ -0,0 +1,67 @@
+# Check that filters deliver the false positive rate they promise: for each
+# layout, hash engine, reduction and target rate, fill a filter to capacity
+# with random keys, measure its rate with filter.measure_fpr and compare it
+# with expected_fpr. Exits with status 1 when any measurement drifts further
+# from theory than the tolerance.
+#
+#   rake bench:fpr                  # or: ruby -Ilib bench/fpr_check.rb
+#
+# Environment:
+#
+#   FPR_KEYS=n          keys added to each filter (default 100000)
+#   FPR_SAMPLES=n       absent keys probed per filter (default 1000000)
+#   FPR_SEED=n          seed for the keys (default random, printed)
+#   FPR_TOLERANCE=0.1   allowed relative drift, on top of four standard
+#                       deviations of sampling error
+require 'filter_bloom/filter_impl'
+
+module FprCheck
+  NKEYS = (ENV['FPR_KEYS'] || 100_000).to_i
+  SAMPLES = (ENV['FPR_SAMPLES'] || 1_000_000).to_i
+  SEED = (ENV['FPR_SEED'] || Random.new_seed % (1 << 64)).to_i
+  TOLERANCE = (ENV['FPR_TOLERANCE'] || 0.1).to_f
+  LAYOUTS = %i[standard blocked]
+  ENGINES = %i[murmur3 wyhash siphash]
+  REDUCTIONS = %i[fastrange mask]
+  TARGETS = [0.01, 0.001]
+
+  module_function
+
+  def check(rng, keys, layout:, hash:, reduction:, fpr:)
+    filter = BloomFilter.new(NKEYS, fpr: fpr, layout: layout, hash: hash,
+                             reduction: reduction)
+    filter.add_all(keys)
+    expected = filter.expected_fpr
+    observed = filter.measure_fpr(samples: SAMPLES, seed: rng.rand(1 << 64))
+    allowed = TOLERANCE * expected + 4 * Math.sqrt(expected / SAMPLES)
+    {
+      name: "#{layout}/#{hash}/#{reduction}/#{fpr}",
+      expected: expected,
+      current: filter.current_fpr,
+      observed: observed,
+      ok: (observed - expected).abs <= allowed
+    }
+  end
+
+  def main
+    rng = Random.new(SEED)
+    keys = Array.new(NKEYS) { rng.bytes(16) }
+    puts "# #{NKEYS} keys, #{SAMPLES} samples, seed #{SEED}, tolerance #{TOLERANCE}"
+    puts format("%-36s %10s %10s %10s %8s", "filter", "expected", "current", "observed",
+                "drift")
+
+    failed = LAYOUTS.product(ENGINES, REDUCTIONS, TARGETS).count do |layout, hash, red, fpr|
+      r = check(rng, keys, layout: layout, hash: hash, reduction: red, fpr: fpr)
+      puts format("%-36s %10.6f %10.6f %10.6f %+7.1f%%%s", r[:name], r[:expected], r[:current],
+                  r[:observed], (r[:observed] / r[:expected] - 1) * 100,
+                  r[:ok] ? "" : "  FAIL")
+      !r[:ok]
+    end
+
+    return unless failed > 0
+    warn "#{failed} filter(s) outside the tolerance"
+    exit 1
+  end
+end
+
+FprCheck.main if $0 == __FILE__
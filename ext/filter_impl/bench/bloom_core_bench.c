@@ -0,0 +1,368 @@
+/* Native benchmark of the bloom filter core, without the Ruby VM in the
+ * way. Built alongside the extension (see extconf.rb):
+ *
+ *   ./bloom_core_bench [-n keys] [-m bytes] [-k hashes] [-l standard|blocked]
+ *                      [-e murmur3|wyhash|siphash] [-s key_length] [-r reps]
+ *
+ * For each operation it prints ns/op, CPU cycles/op and last level cache
+ * misses/op, the best of reps runs. Cycles and misses come from
+ * perf_event_open where the kernel allows it (see
+ * /proc/sys/kernel/perf_event_paranoid); otherwise cycles are read from the
+ * TSC where there is one, and misses are shown as n/a.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+#include "bloom_core.h"
+
+struct counters {
+  double ns;
+  double cycles;    /* < 0 when unavailable */
+  double misses;    /* < 0 when unavailable */
+};
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static int perf_cycles = -1;
+static int perf_misses = -1;
+
+static int
+perf_open(unsigned long long config)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void
+perf_start(int fd)
+{
+  if (fd < 0) return;
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static double
+perf_stop(int fd)
+{
+  unsigned long long count;
+
+  if (fd < 0) return -1;
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+  return (double)count;
+}
+#endif  /* HAVE_LINUX_PERF_EVENT_H */
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef void (*bench_func)(void *);
+
+/* Run fn reps times; keep the fastest run, per op */
+static struct counters
+measure(bench_func fn, void *arg, size_t nops, int reps, bench_func reset)
+{
+  struct counters best = { 0, -1, -1 }, run;
+  int i;
+#ifdef HAVE_RDTSC
+  unsigned long long tsc;
+#endif
+
+  for (i = 0; i < reps; ++i) {
+    if (reset) reset(arg);
+    run.cycles = run.misses = -1;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    perf_start(perf_cycles);
+    perf_start(perf_misses);
+#endif
+#ifdef HAVE_RDTSC
+    tsc = __rdtsc();
+#endif
+    run.ns = now_ns();
+    fn(arg);
+    run.ns = now_ns() - run.ns;
+#ifdef HAVE_RDTSC
+    run.cycles = (double)(__rdtsc() - tsc);
+#endif
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    if (perf_cycles >= 0) run.cycles = perf_stop(perf_cycles);
+    run.misses = perf_stop(perf_misses);
+#endif
+    if (i == 0 || run.ns < best.ns) best = run;
+  }
+
+  best.ns /= nops;
+  if (best.cycles >= 0) best.cycles /= nops;
+  if (best.misses >= 0) best.misses /= nops;
+  return best;
+}
+
+static void
+report(const char *name, struct counters c)
+{
+  char cycles[32], misses[32];
+
+  if (c.cycles >= 0) snprintf(cycles, sizeof(cycles), "%10.1f", c.cycles);
+  else snprintf(cycles, sizeof(cycles), "%10s", "n/a");
+  if (c.misses >= 0) snprintf(misses, sizeof(misses), "%10.3f", c.misses);
+  else snprintf(misses, sizeof(misses), "%10s", "n/a");
+  printf("%-16s %10.2f %s %s\n", name, c.ns, cycles, misses);
+}
+
+struct keyset {
+  char *bytes;
+  size_t *offsets;
+  size_t count;
+};
+
+/* count distinct keys of len bytes, starting with prefix, in shuffled order */
+static void
+make_keys(struct keyset *keys, size_t count, size_t len, char prefix)
+{
+  size_t i, j, tmp, *order;
+  char fmt[32];
+  uint64_t x = 88172645463325252ULL;
+
+  keys->count = count;
+  keys->bytes = malloc(count * (len + 1) + 1);
+  keys->offsets = malloc((count + 1) * sizeof(size_t));
+  order = malloc(count * sizeof(size_t));
+  if (!keys->bytes || !keys->offsets || !order) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < count; ++i) order[i] = i;
+  for (i = count; i > 1; --i) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    j = x % i;
+    tmp = order[i - 1]; order[i - 1] = order[j]; order[j] = tmp;
+  }
+
+  snprintf(fmt, sizeof(fmt), "%%c%%0%dlu", (int)(len > 1 ? len - 1 : 1));
+  for (i = 0; i < count; ++i) {
+    keys->offsets[i] = i * len;
+    /* writes len bytes and a NUL, which the next key overwrites */
+    snprintf(keys->bytes + i * len, len + 1, fmt, prefix, (unsigned long)order[i]);
+  }
+  keys->offsets[count] = count * len;
+  free(order);
+}
+
+struct bench {
+  struct bloom bloom;
+  struct bloom other;
+  struct keyset keys;
+  struct keyset absent;
+  char *found;
+  uint64_t sink;
+};
+
+static void
+clear_bits(void *ptr)
+{
+  struct bench *b = ptr;
+  memset(b->bloom.bitary, 0, b->bloom.arycapa * sizeof(uint64_t));
+}
+
+static void
+run_add(void *ptr)
+{
+  struct bench *b = ptr;
+  size_t i;
+
+  for (i = 0; i < b->keys.count; ++i) {
+    bloom_add(&b->bloom, b->keys.bytes + b->keys.offsets[i],
+              b->keys.offsets[i + 1] - b->keys.offsets[i]);
+  }
+}
+
+static void
+run_add_keys(void *ptr)
+{
+  struct bench *b = ptr;
+  bloom_add_keys(&b->bloom, b->keys.bytes, b->keys.offsets, b->keys.count);
+}
+
+static void
+run_query(void *ptr)
+{
+  struct bench *b = ptr;
+  size_t i;
+
+  for (i = 0; i < b->keys.count; ++i) {
+    b->sink += bloom_query(&b->bloom, b->keys.bytes + b->keys.offsets[i],
+                           b->keys.offsets[i + 1] - b->keys.offsets[i]);
+  }
+}
+
+static void
+run_query_keys(void *ptr)
+{
+  struct bench *b = ptr;
+  bloom_query_keys(&b->bloom, b->keys.bytes, b->keys.offsets, b->keys.count, b->found);
+}
+
+static void
+run_query_absent(void *ptr)
+{
+  struct bench *b = ptr;
+  bloom_query_keys(&b->bloom, b->absent.bytes, b->absent.offsets, b->absent.count, b->found);
+}
+
+static void
+run_popcount(void *ptr)
+{
+  struct bench *b = ptr;
+  b->sink += bloom_popcount(b->bloom.bitary, b->bloom.arycapa);
+}
+
+static void
+run_combine(void *ptr)
+{
+  struct bench *b = ptr;
+  bloom_combine(b->bloom.bitary, b->other.bitary, b->bloom.arycapa, BLOOM_OR, 1);
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-n keys] [-m bytes] [-k hashes] [-l standard|blocked]\n"
+          "       [-e murmur3|wyhash|siphash] [-s key_length] [-r reps]\n", prog);
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench b;
+  size_t nkeys = 1000000, bytes = 0, keylen = 16, words, digits, i;
+  unsigned int nhashes = 7;
+  int reps = 3, layout = BLOOM_LAYOUT_STANDARD, engine = HASH_ENGINE_MURMUR3;
+  const char *layout_name = "standard", *engine_name = "murmur3";
+  void *mem, *other_mem;
+  size_t npositive;
+
+  for (i = 1; i < (size_t)argc; ++i) {
+    const char *opt = argv[i], *val = i + 1 < (size_t)argc ? argv[i + 1] : 0;
+
+    if (!val || opt[0] != '-' || strlen(opt) != 2) usage(argv[0]);
+    switch (opt[1]) {
+    case 'n': nkeys = strtoul(val, 0, 10); break;
+    case 'm': bytes = strtoul(val, 0, 10); break;
+    case 'k': nhashes = (unsigned int)strtoul(val, 0, 10); break;
+    case 's': keylen = strtoul(val, 0, 10); break;
+    case 'r': reps = atoi(val); break;
+    case 'l':
+      layout_name = val;
+      if (strcmp(val, "standard") == 0) layout = BLOOM_LAYOUT_STANDARD;
+      else if (strcmp(val, "blocked") == 0) layout = BLOOM_LAYOUT_BLOCKED;
+      else usage(argv[0]);
+      break;
+    case 'e':
+      engine_name = val;
+      if (strcmp(val, "murmur3") == 0) engine = HASH_ENGINE_MURMUR3;
+      else if (strcmp(val, "wyhash") == 0) engine = HASH_ENGINE_WYHASH;
+      else if (strcmp(val, "siphash") == 0) engine = HASH_ENGINE_SIPHASH;
+      else usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+    ++i;
+  }
+  if (nkeys == 0 || keylen < 2 || reps < 1 || nhashes < 1 || nhashes > BLOOM_MAX_HASH_COUNT)
+    usage(argv[0]);
+
+  /* 10 bits per key unless a size is given, and at least one block */
+  words = (bytes ? bytes : nkeys * 10 / 8) / sizeof(uint64_t);
+  words = (words + BLOOM_WORDS_PER_BLOCK - 1) / BLOOM_WORDS_PER_BLOCK * BLOOM_WORDS_PER_BLOCK;
+  if (words == 0) words = BLOOM_WORDS_PER_BLOCK;
+
+  /* keys are a prefix and the decimal index; lengthen them rather than cut
+   * off digits, which would make duplicate keys
+   */
+  for (digits = 1, i = nkeys - 1; i >= 10; i /= 10) ++digits;
+  if (keylen < digits + 1) keylen = digits + 1;
+
+  bloom_init_cpu();
+  bloom_init(&b.bloom);
+  b.bloom.nhashes = nhashes;
+  b.bloom.layout = layout;
+  b.bloom.engine = engine;
+  for (i = 0; i < HASH_KEY_SIZE; ++i) b.bloom.hashkey[i] = (uint8_t)(i * 37 + 11);
+  b.other = b.bloom;
+  mem = bloom_alloc_bits(&b.bloom, words);
+  other_mem = bloom_alloc_bits(&b.other, words);
+  b.found = malloc(nkeys);
+  if (!mem || !other_mem || !b.found) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  make_keys(&b.keys, nkeys, keylen, 'k');
+  make_keys(&b.absent, nkeys, keylen, 'a');
+  b.sink = 0;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  perf_cycles = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+  perf_misses = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+#endif
+
+  printf("# %lu keys of %lu bytes, %lu KB, k=%u, %s layout, %s\n",
+         (unsigned long)nkeys, (unsigned long)keylen,
+         (unsigned long)(words * sizeof(uint64_t) >> 10), nhashes, layout_name, engine_name);
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  if (perf_cycles < 0) printf("# perf_event_open unavailable; cycles from the TSC\n");
+#endif
+  printf("%-16s %10s %10s %10s\n", "op", "ns/op", "cycles/op", "misses/op");
+
+  report("add", measure(run_add, &b, nkeys, reps, clear_bits));
+  report("add_keys", measure(run_add_keys, &b, nkeys, reps, clear_bits));
+  report("query", measure(run_query, &b, nkeys, reps, 0));
+  report("query_keys", measure(run_query_keys, &b, nkeys, reps, 0));
+  report("query_absent", measure(run_query_absent, &b, nkeys, reps, 0));
+  for (i = 0, npositive = 0; i < nkeys; ++i) npositive += b.found[i];
+  /* per word for the whole-array operations */
+  report("popcount", measure(run_popcount, &b, words, reps, 0));
+  report("combine", measure(run_combine, &b, words, reps, 0));
+
+  printf("# fpr %.5f observed, %.5f expected\n", (double)npositive / nkeys,
+         bloom_expected_fpr(b.bloom.layout, (double)BLOOM_TOTAL_BITS(&b.bloom), nhashes,
+                            (double)nkeys));
+  /* keep the query loops from being optimized away */
+  if (b.sink == 0) printf("# no keys found\n");
+
+  free(mem);
+  free(other_mem);
+  free(b.found);
+  free(b.keys.bytes);
+  free(b.keys.offsets);
+  free(b.absent.bytes);
+  free(b.absent.offsets);
+  return 0;
+}
@@ -0,0 +1,725 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+#include "bloom_core.h"
+
+#define BITS_PER_WORD BLOOM_BITS_PER_WORD
+#define WORDS_PER_BLOCK BLOOM_WORDS_PER_BLOCK
+#define BITS_PER_BLOCK BLOOM_BITS_PER_BLOCK
+#define TOTAL_BITS(b) BLOOM_TOTAL_BITS(b)
+#define CHUNK(b, bit) ((b)->bitary[(bit) / BITS_PER_WORD])
+#define BIT(bit) (UINT64_C(1) << ((bit) % BITS_PER_WORD))
+#define REDUCE(b, hash, n) BLOOM_REDUCE((b)->reduction, hash, n)
+
+/* Number of set bits in a word */
+#ifdef __GNUC__
+#define POPCOUNT64(x) ((uint64_t)__builtin_popcountll(x))
+#else   /* __GNUC__ */
+static inline uint64_t
+popcount64(uint64_t x)
+{
+  x = x - ((x >> 1) & UINT64_C(0x5555555555555555));
+  x = (x & UINT64_C(0x3333333333333333)) + ((x >> 2) & UINT64_C(0x3333333333333333));
+  x = (x + (x >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+  return (x * UINT64_C(0x0101010101010101)) >> 56;
+}
+#define POPCOUNT64(x) popcount64(x)
+#endif  /* __GNUC__ */
+
+/* Concurrent filters set bits with an atomic OR, so that threads adding to
+ * the same word don't lose each other's bits. Reads are relaxed atomic loads,
+ * which are plain loads on every common architecture.
+ */
+#ifdef BLOOM_HAVE_ATOMICS
+#define WORD_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define WORD_FETCH_OR(p, v) __atomic_fetch_or((p), (v), __ATOMIC_RELAXED)
+#define COUNT_FETCH_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#else   /* BLOOM_HAVE_ATOMICS */
+#define WORD_LOAD(p) (*(p))
+#endif  /* BLOOM_HAVE_ATOMICS */
+
+/* Set a bit, adding one to nset if it was clear */
+#define BLOOM_SET_BIT(b, hash, nset) do {                   \
+  uint64_t _bit = REDUCE(b, hash, TOTAL_BITS(b));           \
+  uint64_t *_word = &CHUNK((b),_bit);                       \
+  (nset) += !(*_word & BIT(_bit));                          \
+  *_word |= BIT(_bit);                                      \
+} while (0)
+
+/* Skip the locked instruction when the bit is already set; most are, once
+ * the filter is loaded, and it keeps hot words from bouncing between cores.
+ */
+#define WORD_SET_BIT_ATOMIC(word, bit, nset) do {                   \
+  if (!(WORD_LOAD(word) & (bit)))                                   \
+    (nset) += !(WORD_FETCH_OR(word, bit) & (bit));                  \
+} while (0)
+
+#define BLOOM_SET_BIT_ATOMIC(b, hash, nset) do {            \
+  uint64_t _bit = REDUCE(b, hash, TOTAL_BITS(b));           \
+  WORD_SET_BIT_ATOMIC(&CHUNK((b),_bit), BIT(_bit), nset);   \
+} while (0)
+
+#ifdef __GNUC__
+#define BLOOM_GET_BIT(b, hash) ({                           \
+  uint64_t _bit = REDUCE(b, hash, TOTAL_BITS(b));           \
+  WORD_LOAD(&CHUNK((b),_bit)) & BIT(_bit);                  \
+})
+#else   /* __GNUC__ */
+#define BLOOM_GET_BIT(b, hash) bloom_get_bit(b, hash)
+static uint64_t
+bloom_get_bit(const struct bloom *bloom, uint64_t hash)
+{
+  uint64_t bit = REDUCE(bloom, hash, TOTAL_BITS(bloom));
+  return CHUNK(bloom, bit) & BIT(bit);
+}
+#endif  /* __GNUC__ */
+
+/* Blocked layout: the block is chosen by h1. Within the block, the bit is
+ * taken from the top nine bits of each probe produced by BLOCK_ITERATE.
+ */
+#define BLOCK_BIT_SHIFT (64 - 9)
+#define TOTAL_BLOCKS(b) ((uint64_t)(b)->arycapa / WORDS_PER_BLOCK)
+#define BLOOM_BLOCK(b, hash) \
+  ((b)->bitary + REDUCE(b, hash, TOTAL_BLOCKS(b)) * WORDS_PER_BLOCK)
+
+#define BLOOM_BLOCK_SET_BIT(blk, hash, nset) do {   \
+  uint64_t _bit = (hash) >> BLOCK_BIT_SHIFT;        \
+  uint64_t *_word = &(blk)[_bit / BITS_PER_WORD];   \
+  (nset) += !(*_word & BIT(_bit));                  \
+  *_word |= BIT(_bit);                              \
+} while (0)
+
+#define BLOOM_BLOCK_GET_BIT(blk, hash) \
+  (WORD_LOAD(&(blk)[((hash) >> BLOCK_BIT_SHIFT) / BITS_PER_WORD]) & BIT((hash) >> BLOCK_BIT_SHIFT))
+
+void
+bloom_init(struct bloom *bloom)
+{
+  bloom->bitary  = 0;
+  bloom->arycapa = 0;
+  bloom->nhashes = HASH_COUNT;
+  bloom->layout  = BLOOM_LAYOUT_STANDARD;
+  bloom->reduction = BLOOM_REDUCE_FASTRANGE;
+  bloom->engine  = HASH_ENGINE_MURMUR3;
+  memset(bloom->hashkey, 0, HASH_KEY_SIZE);
+  bloom->track_fill = 0;
+  bloom->nset    = 0;
+  bloom->concurrent = 0;
+}
+
+void *
+bloom_alloc_bits(struct bloom *bloom, size_t arycapa)
+{
+  void *mem = calloc(arycapa + WORDS_PER_BLOCK, sizeof(uint64_t));
+
+  if (!mem) return 0;
+  bloom->arycapa = arycapa;
+  bloom->bitary = BLOOM_ALIGN_BITS(mem);
+  return mem;
+}
+
+#ifdef BLOOM_HAVE_ATOMICS
+static unsigned int
+bloom_set_digest_atomic(struct bloom *bloom, const struct string_digest *digest)
+{
+  uint64_t hash, mask[WORDS_PER_BLOCK];
+  uint64_t *blk;
+  unsigned int nset = 0;
+  size_t i;
+
+  switch (bloom->layout) {
+  case BLOOM_LAYOUT_STANDARD:
+    HASH_ITERATE(digest, bloom->nhashes, hash, {
+      BLOOM_SET_BIT_ATOMIC(bloom, hash, nset);
+    });
+    break;
+  case BLOOM_LAYOUT_BLOCKED:
+    /* gather the bits per word, for at most one locked OR per word */
+    blk = BLOOM_BLOCK(bloom, digest->h1);
+    memset(mask, 0, sizeof(mask));
+    BLOCK_ITERATE(digest, bloom->nhashes, hash, {
+      mask[(hash >> BLOCK_BIT_SHIFT) / BITS_PER_WORD] |= BIT(hash >> BLOCK_BIT_SHIFT);
+    });
+    for (i = 0; i < WORDS_PER_BLOCK; ++i) {
+      if (mask[i] & ~WORD_LOAD(&blk[i]))
+        nset += (unsigned int)POPCOUNT64(mask[i] & ~WORD_FETCH_OR(&blk[i], mask[i]));
+    }
+    break;
+  }
+
+  if (bloom->track_fill) COUNT_FETCH_ADD(&bloom->nset, nset);
+  return nset;
+}
+#endif  /* BLOOM_HAVE_ATOMICS */
+
+static inline unsigned int
+set_digest(struct bloom *bloom, const struct string_digest *digest)
+{
+  uint64_t hash;
+  uint64_t *blk;
+  unsigned int nset = 0;
+
+#ifdef BLOOM_HAVE_ATOMICS
+  if (bloom->concurrent) return bloom_set_digest_atomic(bloom, digest);
+#endif
+
+  switch (bloom->layout) {
+  case BLOOM_LAYOUT_STANDARD:
+    HASH_ITERATE(digest, bloom->nhashes, hash, {
+      BLOOM_SET_BIT(bloom, hash, nset);
+    });
+    break;
+  case BLOOM_LAYOUT_BLOCKED:
+    blk = BLOOM_BLOCK(bloom, digest->h1);
+    BLOCK_ITERATE(digest, bloom->nhashes, hash, {
+      BLOOM_BLOCK_SET_BIT(blk, hash, nset);
+    });
+    break;
+  }
+
+  if (bloom->track_fill) bloom->nset += nset;
+  return nset;
+}
+
+static inline int
+get_digest(const struct bloom *bloom, const struct string_digest *digest)
+{
+  uint64_t hash;
+  const uint64_t *blk;
+
+  switch (bloom->layout) {
+  case BLOOM_LAYOUT_STANDARD:
+    HASH_ITERATE(digest, bloom->nhashes, hash, {
+      if (!BLOOM_GET_BIT(bloom, hash)) {
+        return 0;
+      }
+    });
+    break;
+  case BLOOM_LAYOUT_BLOCKED:
+    blk = BLOOM_BLOCK(bloom, digest->h1);
+    BLOCK_ITERATE(digest, bloom->nhashes, hash, {
+      if (!BLOOM_BLOCK_GET_BIT(blk, hash)) {
+        return 0;
+      }
+    });
+    break;
+  }
+
+  return 1;
+}
+
+static inline void
+prefetch_digest(const struct bloom *bloom, const struct string_digest *digest, int rw)
+{
+  uint64_t hash;
+
+  switch (bloom->layout) {
+  case BLOOM_LAYOUT_STANDARD:
+    HASH_ITERATE(digest, bloom->nhashes, hash, {
+      BLOOM_PREFETCH_RW(&CHUNK(bloom, REDUCE(bloom, hash, TOTAL_BITS(bloom))), rw);
+    });
+    break;
+  case BLOOM_LAYOUT_BLOCKED:
+    BLOOM_PREFETCH_RW(BLOOM_BLOCK(bloom, digest->h1), rw);
+    break;
+  }
+}
+
+unsigned int
+bloom_set_digest(struct bloom *bloom, const struct string_digest *digest)
+{
+  return set_digest(bloom, digest);
+}
+
+int
+bloom_get_digest(const struct bloom *bloom, const struct string_digest *digest)
+{
+  return get_digest(bloom, digest);
+}
+
+void
+bloom_prefetch_digest(const struct bloom *bloom, const struct string_digest *digest, int rw)
+{
+  prefetch_digest(bloom, digest, rw);
+}
+
+unsigned int
+bloom_add(struct bloom *bloom, const char *str, size_t len)
+{
+  struct string_digest digest;
+
+  BLOOM_DIGEST(bloom, str, len, &digest);
+  return set_digest(bloom, &digest);
+}
+
+int
+bloom_query(const struct bloom *bloom, const char *str, size_t len)
+{
+  struct string_digest digest;
+
+  BLOOM_DIGEST(bloom, str, len, &digest);
+  return get_digest(bloom, &digest);
+}
+
+#define KEY_PTR(bytes, offsets, i) ((bytes) + (offsets)[i])
+#define KEY_LEN(offsets, i) ((offsets)[(i) + 1] - (offsets)[i])
+
+void
+bloom_add_keys(struct bloom *bloom, const char *bytes, const size_t *offsets, size_t count)
+{
+  struct string_digest digests[BLOOM_BATCH];
+  size_t i, j, n;
+
+  for (i = 0; i < count; i += n) {
+    n = count - i < BLOOM_BATCH ? count - i : BLOOM_BATCH;
+    for (j = 0; j < n; ++j) {
+      BLOOM_DIGEST(bloom, KEY_PTR(bytes, offsets, i + j), KEY_LEN(offsets, i + j), &digests[j]);
+      prefetch_digest(bloom, &digests[j], BLOOM_PREFETCH_WRITE);
+    }
+    for (j = 0; j < n; ++j) {
+      set_digest(bloom, &digests[j]);
+    }
+  }
+}
+
+void
+bloom_query_keys(const struct bloom *bloom, const char *bytes, const size_t *offsets,
+                 size_t count, char *found)
+{
+  struct string_digest digests[BLOOM_BATCH];
+  size_t i, j, n;
+
+  for (i = 0; i < count; i += n) {
+    n = count - i < BLOOM_BATCH ? count - i : BLOOM_BATCH;
+    for (j = 0; j < n; ++j) {
+      BLOOM_DIGEST(bloom, KEY_PTR(bytes, offsets, i + j), KEY_LEN(offsets, i + j), &digests[j]);
+      prefetch_digest(bloom, &digests[j], BLOOM_PREFETCH_READ);
+    }
+    for (j = 0; j < n; ++j) {
+      found[i + j] = get_digest(bloom, &digests[j]);
+    }
+  }
+}
+
+void
+bloom_add_digests(struct bloom *bloom, const struct string_digest *digests, size_t count)
+{
+  size_t i, j, n;
+
+  for (i = 0; i < count; i += n) {
+    n = count - i < BLOOM_BATCH ? count - i : BLOOM_BATCH;
+    for (j = 0; j < n; ++j) {
+      prefetch_digest(bloom, &digests[i + j], BLOOM_PREFETCH_WRITE);
+    }
+    for (j = 0; j < n; ++j) {
+      set_digest(bloom, &digests[i + j]);
+    }
+  }
+}
+
+void
+bloom_query_digests(const struct bloom *bloom, const struct string_digest *digests,
+                    size_t count, char *found)
+{
+  size_t i, j, n;
+
+  for (i = 0; i < count; i += n) {
+    n = count - i < BLOOM_BATCH ? count - i : BLOOM_BATCH;
+    for (j = 0; j < n; ++j) {
+      prefetch_digest(bloom, &digests[i + j], BLOOM_PREFETCH_READ);
+    }
+    for (j = 0; j < n; ++j) {
+      found[i + j] = get_digest(bloom, &digests[i + j]);
+    }
+  }
+}
+
+/* Probability that a block of the blocked layout holding i items reports a
+ * false positive, weighted by the Poisson distribution of items per block
+ * (Putze, Sanders, Singler: "Cache-, Hash- and Space-Efficient Bloom Filters").
+ */
+static double
+blocked_fpr(double nblocks, double k, double n)
+{
+  double lambda = n / nblocks, fpr = 0, limit, i;
+
+  limit = lambda + 10 * sqrt(lambda) + 10;
+  for (i = 0; i <= limit; ++i) {
+    double p = exp(-lambda + i * log(lambda) - lgamma(i + 1));
+    fpr += p * pow(1 - pow(1 - 1.0 / BITS_PER_BLOCK, k * i), k);
+  }
+
+  return fpr;
+}
+
+double
+bloom_expected_fpr(enum bloom_layout layout, double m, double k, double n)
+{
+  if (m < 1) return 1.0;
+  if (n == 0) return 0.0;
+
+  switch (layout) {
+  case BLOOM_LAYOUT_BLOCKED:
+    return blocked_fpr(floor(m / BITS_PER_BLOCK), k, n);
+  default:
+    return pow(1 - exp(-k * n / m), k);
+  }
+}
+
+typedef uint64_t (*popcount_func)(const uint64_t *, size_t);
+
+static uint64_t
+bits_popcount_scalar(const uint64_t *words, size_t n)
+{
+  uint64_t count = 0;
+  size_t i;
+
+  for (i = 0; i < n; ++i) count += POPCOUNT64(words[i]);
+  return count;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("popcnt")))
+static uint64_t
+bits_popcount_popcnt(const uint64_t *words, size_t n)
+{
+  uint64_t count = 0;
+  size_t i;
+
+  for (i = 0; i < n; ++i) count += (uint64_t)__builtin_popcountll(words[i]);
+  return count;
+}
+
+/* Mula's nibble lookup: vpshufb counts the bits of each nibble, and vpsadbw
+ * sums the byte counts into four 64-bit lanes.
+ */
+__attribute__((target("avx2")))
+static uint64_t
+bits_popcount_avx2(const uint64_t *words, size_t n)
+{
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+  uint64_t lanes[4];
+  size_t i, nvec = n & ~(size_t)3;
+
+  for (i = 0; i < nvec; i += 4) {
+    __m256i v = _mm256_load_si256((const __m256i *)(words + i));
+    __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi),
+                                                    _mm256_setzero_si256()));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, total);
+
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    bits_popcount_scalar(words + nvec, n - nvec);
+}
+#endif  /* HAVE_X86_SIMD */
+
+/* Chosen for the running CPU by bloom_init_cpu */
+static popcount_func bits_popcount = bits_popcount_scalar;
+
+uint64_t
+bloom_popcount(const uint64_t *words, size_t n)
+{
+  return bits_popcount(words, n);
+}
+
+typedef void (*bits_op_func)(uint64_t *, const uint64_t *, size_t, enum bloom_op);
+
+static void
+bits_op_scalar(uint64_t *dst, const uint64_t *src, size_t n, enum bloom_op op)
+{
+  size_t i;
+
+  if (op == BLOOM_OR) {
+    for (i = 0; i < n; ++i) dst[i] |= src[i];
+  }
+  else {
+    for (i = 0; i < n; ++i) dst[i] &= src[i];
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+/* Both bit arrays are block aligned, so the vector loads are aligned too */
+static void
+bits_op_sse2(uint64_t *dst, const uint64_t *src, size_t n, enum bloom_op op)
+{
+  size_t i, nvec = n & ~(size_t)1;
+
+  if (op == BLOOM_OR) {
+    for (i = 0; i < nvec; i += 2) {
+      __m128i a = _mm_load_si128((const __m128i *)(dst + i));
+      __m128i b = _mm_load_si128((const __m128i *)(src + i));
+      _mm_store_si128((__m128i *)(dst + i), _mm_or_si128(a, b));
+    }
+  }
+  else {
+    for (i = 0; i < nvec; i += 2) {
+      __m128i a = _mm_load_si128((const __m128i *)(dst + i));
+      __m128i b = _mm_load_si128((const __m128i *)(src + i));
+      _mm_store_si128((__m128i *)(dst + i), _mm_and_si128(a, b));
+    }
+  }
+  bits_op_scalar(dst + nvec, src + nvec, n - nvec, op);
+}
+
+__attribute__((target("avx2")))
+static void
+bits_op_avx2(uint64_t *dst, const uint64_t *src, size_t n, enum bloom_op op)
+{
+  size_t i, nvec = n & ~(size_t)3;
+
+  if (op == BLOOM_OR) {
+    for (i = 0; i < nvec; i += 4) {
+      __m256i a = _mm256_load_si256((const __m256i *)(dst + i));
+      __m256i b = _mm256_load_si256((const __m256i *)(src + i));
+      _mm256_store_si256((__m256i *)(dst + i), _mm256_or_si256(a, b));
+    }
+  }
+  else {
+    for (i = 0; i < nvec; i += 4) {
+      __m256i a = _mm256_load_si256((const __m256i *)(dst + i));
+      __m256i b = _mm256_load_si256((const __m256i *)(src + i));
+      _mm256_store_si256((__m256i *)(dst + i), _mm256_and_si256(a, b));
+    }
+  }
+  bits_op_scalar(dst + nvec, src + nvec, n - nvec, op);
+}
+#endif  /* HAVE_X86_SIMD */
+
+/* Chosen for the running CPU by bloom_init_cpu */
+static bits_op_func bits_op = bits_op_scalar;
+
+struct combine_range {
+  uint64_t *dst;
+  const uint64_t *src;
+  size_t nwords;
+  enum bloom_op op;
+};
+
+static void *
+combine_range_run(void *ptr)
+{
+  struct combine_range *range = ptr;
+
+  bits_op(range->dst, range->src, range->nwords, range->op);
+  return 0;
+}
+
+/* Split the words into block aligned ranges, one per thread. The calling
+ * thread takes the first range itself.
+ */
+void
+bloom_combine(uint64_t *dst, const uint64_t *src, size_t n, enum bloom_op op, int nthreads)
+{
+  struct combine_range whole;
+#ifdef HAVE_PTHREAD_H
+  struct combine_range ranges[BLOOM_MAX_THREADS];
+  pthread_t threads[BLOOM_MAX_THREADS];
+  int started[BLOOM_MAX_THREADS];
+  size_t per, start;
+  int i;
+#endif
+
+  whole.dst = dst;
+  whole.src = src;
+  whole.nwords = n;
+  whole.op = op;
+
+#ifdef HAVE_PTHREAD_H
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > BLOOM_MAX_THREADS) nthreads = BLOOM_MAX_THREADS;
+
+  per = (n / nthreads + WORDS_PER_BLOCK - 1) & ~(size_t)(WORDS_PER_BLOCK - 1);
+  for (i = 0, start = 0; i < nthreads; ++i, start += per) {
+    ranges[i] = whole;
+    ranges[i].dst += start;
+    ranges[i].src += start;
+    ranges[i].nwords = start >= n ? 0 : (n - start < per ? n - start : per);
+    started[i] = i > 0 && ranges[i].nwords > 0 &&
+      pthread_create(&threads[i], 0, combine_range_run, &ranges[i]) == 0;
+  }
+  combine_range_run(&ranges[0]);
+  for (i = 1; i < nthreads; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], 0);
+    }
+    else if (ranges[i].nwords > 0) {
+      /* pthread_create failed; do it here */
+      combine_range_run(&ranges[i]);
+    }
+  }
+#else   /* HAVE_PTHREAD_H */
+  (void)nthreads;
+  combine_range_run(&whole);
+#endif  /* HAVE_PTHREAD_H */
+}
+
+unsigned int
+bloom_probe_bits(const struct bloom *bloom, const struct string_digest *digest, uint64_t *bits)
+{
+  uint64_t hash, base;
+  unsigned int n = 0;
+
+  switch (bloom->layout) {
+  case BLOOM_LAYOUT_STANDARD:
+    HASH_ITERATE(digest, bloom->nhashes, hash, {
+      bits[n++] = REDUCE(bloom, hash, TOTAL_BITS(bloom));
+    });
+    break;
+  case BLOOM_LAYOUT_BLOCKED:
+    base = REDUCE(bloom, digest->h1, TOTAL_BLOCKS(bloom)) * BITS_PER_BLOCK;
+    BLOCK_ITERATE(digest, bloom->nhashes, hash, {
+      bits[n++] = base + (hash >> BLOCK_BIT_SHIFT);
+    });
+    break;
+  }
+
+  return n;
+}
+
+/* dst = rows[0] & rows[1] & ... & rows[k - 1], a word (or vector) at a time,
+ * so each row is read once and dst written once.
+ */
+typedef void (*rows_and_func)(uint64_t *, const uint64_t *const *, unsigned int, size_t);
+
+static void
+rows_and_scalar(uint64_t *dst, const uint64_t *const *rows, unsigned int k, size_t n)
+{
+  uint64_t acc;
+  unsigned int j;
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    acc = rows[0][i];
+    for (j = 1; j < k; ++j) acc &= rows[j][i];
+    dst[i] = acc;
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+/* Rows are whole 256-bit vectors from a block aligned array */
+static void
+rows_and_sse2(uint64_t *dst, const uint64_t *const *rows, unsigned int k, size_t n)
+{
+  __m128i acc;
+  unsigned int j;
+  size_t i;
+
+  for (i = 0; i < n; i += 2) {
+    acc = _mm_load_si128((const __m128i *)(rows[0] + i));
+    for (j = 1; j < k; ++j)
+      acc = _mm_and_si128(acc, _mm_load_si128((const __m128i *)(rows[j] + i)));
+    _mm_store_si128((__m128i *)(dst + i), acc);
+  }
+}
+
+__attribute__((target("avx2")))
+static void
+rows_and_avx2(uint64_t *dst, const uint64_t *const *rows, unsigned int k, size_t n)
+{
+  __m256i acc;
+  unsigned int j;
+  size_t i;
+
+  for (i = 0; i < n; i += 4) {
+    acc = _mm256_load_si256((const __m256i *)(rows[0] + i));
+    for (j = 1; j < k; ++j)
+      acc = _mm256_and_si256(acc, _mm256_load_si256((const __m256i *)(rows[j] + i)));
+    _mm256_store_si256((__m256i *)(dst + i), acc);
+  }
+}
+#endif  /* HAVE_X86_SIMD */
+
+/* Chosen for the running CPU by bloom_init_cpu */
+static rows_and_func rows_and = rows_and_scalar;
+
+#define SLOT_WORD(slot) ((slot) / BITS_PER_WORD)
+
+void
+bloom_bank_add(struct bloom_bank *bank, size_t slot, const struct string_digest *digest)
+{
+  uint64_t bits[BLOOM_MAX_HASH_COUNT];
+  unsigned int i, n;
+
+  n = bloom_probe_bits(&bank->shape, digest, bits);
+  for (i = 0; i < n; ++i) {
+    BLOOM_BANK_ROW(bank, bits[i])[SLOT_WORD(slot)] |= BIT(slot);
+  }
+}
+
+uint64_t
+bloom_bank_query(const struct bloom_bank *bank, const struct string_digest *digest,
+                 uint64_t *slots)
+{
+  uint64_t bits[BLOOM_MAX_HASH_COUNT];
+  const uint64_t *rows[BLOOM_MAX_HASH_COUNT];
+  unsigned int i, n;
+
+  n = bloom_probe_bits(&bank->shape, digest, bits);
+  for (i = 0; i < n; ++i) {
+    rows[i] = BLOOM_BANK_ROW(bank, bits[i]);
+    BLOOM_PREFETCH(rows[i], BLOOM_PREFETCH_READ);
+  }
+  rows_and(slots, rows, n, bank->rowwords);
+
+  return bits_popcount(slots, bank->rowwords);
+}
+
+void
+bloom_bank_store(struct bloom_bank *bank, size_t slot, const uint64_t *bitary)
+{
+  uint64_t i, *word;
+
+  for (i = 0; i < TOTAL_BITS(&bank->shape); ++i) {
+    word = &BLOOM_BANK_ROW(bank, i)[SLOT_WORD(slot)];
+    *word = (*word & ~BIT(slot)) | (((bitary[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1)
+                                    << (slot % BITS_PER_WORD));
+  }
+}
+
+void
+bloom_bank_load(const struct bloom_bank *bank, size_t slot, uint64_t *bitary)
+{
+  uint64_t i;
+
+  memset(bitary, 0, bank->shape.arycapa * sizeof(uint64_t));
+  for (i = 0; i < TOTAL_BITS(&bank->shape); ++i) {
+    if (BLOOM_BANK_ROW(bank, i)[SLOT_WORD(slot)] & BIT(slot))
+      bitary[i / BITS_PER_WORD] |= BIT(i);
+  }
+}
+
+void
+bloom_bank_clear(struct bloom_bank *bank, size_t slot)
+{
+  uint64_t i;
+
+  for (i = 0; i < TOTAL_BITS(&bank->shape); ++i) {
+    BLOOM_BANK_ROW(bank, i)[SLOT_WORD(slot)] &= ~BIT(slot);
+  }
+}
+
+void
+bloom_init_cpu(void)
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  bits_op = __builtin_cpu_supports("avx2") ? bits_op_avx2 : bits_op_sse2;
+  rows_and = __builtin_cpu_supports("avx2") ? rows_and_avx2 : rows_and_sse2;
+  if (__builtin_cpu_supports("avx2"))
+    bits_popcount = bits_popcount_avx2;
+  else if (__builtin_cpu_supports("popcnt"))
+    bits_popcount = bits_popcount_popcnt;
+#endif
+}
@@ -0,0 +1,202 @@
+#ifndef FILTER_BLOOM_CORE
+#define FILTER_BLOOM_CORE
+
+#include <stddef.h>
+#include <stdint.h>
+#include "string_hash.h"
+
+/* The bit array and probe logic of a bloom filter, with no dependency on
+ * Ruby. The extension wraps a struct bloom in each BloomFilter; the native
+ * benchmark in bench/ drives it directly.
+ */
+
+enum bloom_layout {
+  BLOOM_LAYOUT_STANDARD,
+  BLOOM_LAYOUT_BLOCKED
+};
+
+/* How a 64-bit probe is reduced to a bit (or block) index. Masking needs the
+ * range to be a power of two; fastrange works for any size.
+ */
+enum bloom_reduction {
+  BLOOM_REDUCE_MASK,
+  BLOOM_REDUCE_FASTRANGE
+};
+
+enum bloom_op {
+  BLOOM_OR,
+  BLOOM_AND
+};
+
+struct bloom {
+  uint64_t *bitary;
+  size_t arycapa;
+  unsigned int nhashes;
+  enum bloom_layout layout;
+  enum bloom_reduction reduction;
+  unsigned int engine;
+  uint8_t hashkey[HASH_KEY_SIZE];
+  int track_fill;
+  uint64_t nset;
+  int concurrent;
+};
+
+#define BLOOM_BITS_PER_WORD 64
+#define BLOOM_TOTAL_BITS(b) ((uint64_t)(b)->arycapa * BLOOM_BITS_PER_WORD)
+#define BLOOM_MAX_HASH_COUNT 32
+
+/* Blocked layout: all of a key's bits land in one cache line sized block */
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_WORDS_PER_BLOCK (BLOOM_BLOCK_BYTES / sizeof(uint64_t))
+#define BLOOM_BITS_PER_BLOCK (BLOOM_BLOCK_BYTES * 8)
+
+/* Round an allocation of arycapa + BLOOM_WORDS_PER_BLOCK words up to a block
+ * boundary, so that a block of the blocked layout never straddles two cache
+ * lines and the vector loops can use aligned loads.
+ */
+#define BLOOM_ALIGN_BITS(mem) \
+  ((uint64_t *)(((size_t)(mem) + BLOOM_BLOCK_BYTES - 1) & ~(size_t)(BLOOM_BLOCK_BYTES - 1)))
+
+/* Number of keys hashed ahead of touching their bits in bulk operations */
+#define BLOOM_BATCH 16
+
+/* Upper bound on the threads of bloom_combine */
+#define BLOOM_MAX_THREADS 64
+
+#define BLOOM_PREFETCH_READ 0
+#define BLOOM_PREFETCH_WRITE 1
+
+#ifdef __GNUC__
+#define BLOOM_PREFETCH(addr, rw) __builtin_prefetch((addr), (rw), 1)
+#define BLOOM_HAVE_ATOMICS 1
+#else   /* __GNUC__ */
+#define BLOOM_PREFETCH(addr, rw) ((void)(addr))
+#endif  /* __GNUC__ */
+
+/* __builtin_prefetch needs a constant rw, which an unoptimized build won't
+ * propagate into a function argument.
+ */
+#define BLOOM_PREFETCH_RW(addr, rw)                                     \
+  ((rw) == BLOOM_PREFETCH_WRITE ? BLOOM_PREFETCH(addr, BLOOM_PREFETCH_WRITE) \
+                                : BLOOM_PREFETCH(addr, BLOOM_PREFETCH_READ))
+
+/* High 64 bits of a 64x64-bit product */
+static inline uint64_t
+bloom_mulhi64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  return (uint64_t)(((unsigned __int128)a * b) >> 64);
+#else
+  uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  uint64_t lo_hi = a_lo * b_hi, hi_lo = a_hi * b_lo;
+  uint64_t cross = ((a_lo * b_lo) >> 32) + (uint32_t)hi_lo + lo_hi;
+
+  return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+/* Map hash onto [0, n): a mask for power-of-two n, otherwise Lemire's
+ * multiply-high "fastrange". Either avoids a 64-bit division per probe.
+ */
+#define BLOOM_REDUCE(reduction, hash, n) \
+  ((reduction) == BLOOM_REDUCE_MASK ? (hash) & ((n) - 1) : bloom_mulhi64((hash), (n)))
+
+#define BLOOM_DIGEST(b, str, len, digest) \
+  digest_funcs[(b)->engine]((str), (len), (b)->hashkey, (digest))
+
+/* Defaults: no bit array, HASH_COUNT hashes, standard layout, fastrange,
+ * murmur3.
+ */
+void bloom_init(struct bloom *bloom);
+
+/* Allocate a zeroed, block aligned bit array of arycapa words with calloc.
+ * Returns the pointer to pass to free, or 0 when out of memory.
+ */
+void *bloom_alloc_bits(struct bloom *bloom, size_t arycapa);
+
+/* Set the bits for a digest. Returns the number of bits that were clear. */
+unsigned int bloom_set_digest(struct bloom *bloom, const struct string_digest *digest);
+int bloom_get_digest(const struct bloom *bloom, const struct string_digest *digest);
+
+/* Start loading the words that bloom_set_digest or bloom_get_digest is about
+ * to touch.
+ */
+void bloom_prefetch_digest(const struct bloom *bloom, const struct string_digest *digest, int rw);
+
+unsigned int bloom_add(struct bloom *bloom, const char *str, size_t len);
+int bloom_query(const struct bloom *bloom, const char *str, size_t len);
+
+/* Bulk operations on count keys packed into bytes, key i running from
+ * offsets[i] to offsets[i + 1]. Keys are hashed BLOOM_BATCH at a time, and
+ * their words prefetched before any bit is touched.
+ */
+void bloom_add_keys(struct bloom *bloom, const char *bytes, const size_t *offsets, size_t count);
+void bloom_query_keys(const struct bloom *bloom, const char *bytes, const size_t *offsets,
+                      size_t count, char *found);
+
+/* The same, for keys that were hashed beforehand */
+void bloom_add_digests(struct bloom *bloom, const struct string_digest *digests, size_t count);
+void bloom_query_digests(const struct bloom *bloom, const struct string_digest *digests,
+                         size_t count, char *found);
+
+/* Number of set bits in an array of words */
+uint64_t bloom_popcount(const uint64_t *words, size_t n);
+
+/* dst = dst op src, over n block aligned words, split between nthreads
+ * threads (at most BLOOM_MAX_THREADS) where pthreads are available.
+ */
+void bloom_combine(uint64_t *dst, const uint64_t *src, size_t n, enum bloom_op op, int nthreads);
+
+/* Expected false positive rate of m bits and k hashes holding n items */
+double bloom_expected_fpr(enum bloom_layout layout, double m, double k, double n);
+
+/* Bit indexes probed for a digest, in probe order; returns nhashes */
+unsigned int bloom_probe_bits(const struct bloom *bloom, const struct string_digest *digest,
+                              uint64_t *bits);
+
+/* nslots filters of one shape, stored bit-sliced as in signature files and
+ * BitFunnel: row i holds bit i of every filter, one bit per slot. A query
+ * hashes the key once and ANDs its k rows into a bitmap of the slots that
+ * may hold it. The shape's bitary is unused; its arycapa gives the number of
+ * rows.
+ */
+struct bloom_bank {
+  struct bloom shape;
+  size_t nslots;
+  size_t rowwords;
+  uint64_t *rows;
+};
+
+/* The caller allocates the rows, BLOOM_BANK_WORDS words from a block aligned
+ * address. Each row is padded to a whole 256-bit vector, the widest load of
+ * the combine loop, so a bank takes at least 256 bits per row however few
+ * its slots.
+ */
+#define BLOOM_BANK_VECTOR_WORDS 4
+#define BLOOM_BANK_ROW_WORDS(nslots) \
+  (((nslots) + BLOOM_BANK_VECTOR_WORDS * BLOOM_BITS_PER_WORD - 1) / \
+   (BLOOM_BANK_VECTOR_WORDS * BLOOM_BITS_PER_WORD) * BLOOM_BANK_VECTOR_WORDS)
+
+#define BLOOM_BANK_ROW(bank, bit) ((bank)->rows + (bit) * (bank)->rowwords)
+#define BLOOM_BANK_WORDS(bank) (BLOOM_TOTAL_BITS(&(bank)->shape) * (bank)->rowwords)
+
+void bloom_bank_add(struct bloom_bank *bank, size_t slot, const struct string_digest *digest);
+
+/* AND the key's rows into slots, rowwords block aligned words. Returns the
+ * number of candidate slots.
+ */
+uint64_t bloom_bank_query(const struct bloom_bank *bank, const struct string_digest *digest,
+                          uint64_t *slots);
+
+/* Copy a filter's bit array, of the bank's shape, into or out of a slot */
+void bloom_bank_store(struct bloom_bank *bank, size_t slot, const uint64_t *bitary);
+void bloom_bank_load(const struct bloom_bank *bank, size_t slot, uint64_t *bitary);
+
+/* Empty a slot */
+void bloom_bank_clear(struct bloom_bank *bank, size_t slot);
+
+/* Pick the popcount, combine and bank loops for the running CPU */
+void bloom_init_cpu(void);
+
+#endif
@@ -1,4 +1,24 @@
 require 'mkmf'
 
 dir_config("filter_impl")
+have_header("sys/mman.h")
+have_header("pthread.h")
+have_header("linux/perf_event.h")
+$cleanfiles << "bloom_core_bench"
 create_makefile("filter_bloom/filter_impl")
+
+# bench/bloom_core_bench.c drives the Ruby-free core (bloom_core.c and the
+# hash engines) directly. "make bench" builds it next to the extension, from
+# the same objects; it isn't part of "all", so installing the gem skips it.
+core_objs = %w[bloom_core string_hash murmur3 wyhash siphash24].map { |o| "#{o}.#{$OBJEXT}" }
+File.open("Makefile", "a") do |mf|
+  mf.puts <<~MAKE
+
+    .PHONY: bench
+    bench: bloom_core_bench
+
+    bloom_core_bench: $(srcdir)/bench/bloom_core_bench.c #{core_objs.join(" ")}
+    \t$(ECHO) linking $@
+    \t$(Q) $(CC) $(INCFLAGS) $(CPPFLAGS) $(CFLAGS) -o $@ $(srcdir)/bench/bloom_core_bench.c #{core_objs.join(" ")} -lm#{" -lpthread" if $defs.include?("-DHAVE_PTHREAD_H")}
+  MAKE
+end
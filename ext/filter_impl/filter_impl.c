@@ -1,357 +1,4274 @@
 #include "ruby.h"
-#include "string_hash.h"
+#include "ruby/thread.h"
+#include <math.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "bloom_core.h"
+#include "xxhash.h"
+
+/* Operational counters, kept for filters created with stats: true */
+struct filter_stats {
+  uint64_t adds;
+  uint64_t queries;
+  uint64_t positives;
+  uint64_t handler_calls;
+  uint64_t batches;
+};
 
 struct filter {
-  size_t arycapa;
+  struct bloom bloom;
+  size_t capa;
   VALUE block;
-  size_t *bitary;
+  void *bitmem;
+  void *map;
+  size_t maplen;
+  int readonly;
+  int track_stats;
+  struct filter_stats stats;
+  int batch_handler;
+};
+
+#define TOTAL_BITS(f) BLOOM_TOTAL_BITS(&(f)->bloom)
+
+/* A frozen filter may be queried from several Ractors at once, so the
+ * counters are bumped with a relaxed atomic add. Filters without stats only
+ * pay for the test of track_stats.
+ */
+#ifdef BLOOM_HAVE_ATOMICS
+#define STATS_ADD(f, field, n) do {                                     \
+  if ((f)->track_stats)                                                 \
+    __atomic_fetch_add(&(f)->stats.field, (uint64_t)(n), __ATOMIC_RELAXED); \
+} while (0)
+#else   /* BLOOM_HAVE_ATOMICS */
+#define STATS_ADD(f, field, n) do {                                     \
+  if ((f)->track_stats) (f)->stats.field += (uint64_t)(n);              \
+} while (0)
+#endif  /* BLOOM_HAVE_ATOMICS */
+
+/* Number of prefetch windows needed for n keys */
+#define BATCH_COUNT(n) (((n) + BLOOM_BATCH - 1) / BLOOM_BATCH)
+
+#define DEFAULT_BITS_PER_ITEM 8
+#define LN2 0.69314718055994530942
+
+/* Number of keys copied out of Ruby strings per release of the GVL */
+#define NOGVL_CHUNK 65536
+
+/* Whole bit arrays at least this many words long are scanned without the GVL */
+#define WORDS_NOGVL_THRESHOLD (1 << 17)
+
+#define FILTER_CHECK(f) do {                                   \
+  if ((f) && (f)->bloom.bitary == 0) {                         \
+    rb_raise(rb_eRuntimeError, "Uninitialized bloom filter");  \
+  }                                                            \
+} while (0)
+
+#define FILTER_CHECK_WRITABLE(f) do {                          \
+  FILTER_CHECK(f);                                             \
+  if ((f)->readonly) {                                         \
+    rb_raise(rb_eIOError, "bloom filter is mapped read-only"); \
+  }                                                            \
+} while (0)
+
+#define FILTER_GET_DIGEST(f, obj, digest) do {                         \
+  FILTER_CHECK(f);                                                     \
+  get_digest(obj, (f)->bloom.engine, (f)->bloom.hashkey, digest);      \
+} while (0)
+
+/* A frozen filter can be shared between Ractors */
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+#define FILTER_TYPED_SHAREABLE RUBY_TYPED_FROZEN_SHAREABLE
+#else
+#define FILTER_TYPED_SHAREABLE 0
+#endif
+
+static ID id_size;
+static ID id_each;
+static ID id_call;
+static ID id_layout;
+static ID id_bitmap;
+static ID id_fpr;
+static ID id_bits_per_item;
+static ID id_hashes;
+static ID id_memory;
+static ID id_standard;
+static ID id_blocked;
+static ID id_reduction;
+static ID id_mask;
+static ID id_fastrange;
+static ID id_read;
+static ID id_write;
+static ID id_mode;
+static ID id_readonly;
+static ID id_readwrite;
+static ID id_advice;
+static ID id_normal;
+static ID id_random;
+static ID id_sequential;
+static ID id_willneed;
+static ID id_populate;
+static ID id_verify;
+static ID id_growth;
+static ID id_tightening;
+static ID id_fill;
+static ID id_counter_bits;
+static ID id_threads;
+static ID id_track_fill;
+static ID id_concurrent;
+static ID id_hash;
+static ID id_hash_key;
+static ID id_murmur3;
+static ID id_wyhash;
+static ID id_siphash;
+static ID id_urandom;
+static ID id_stats;
+static ID id_adds;
+static ID id_queries;
+static ID id_positives;
+static ID id_handler_calls;
+static ID id_batches;
+static ID id_samples;
+static ID id_seed;
+static ID id_batch_handler;
+static ID id_current;
+static ID id_main;
+
+static VALUE cBloomFilter;
+static VALUE cScalable;
+static VALUE cCounting;
+static VALUE cDigest;
+static VALUE cBank;
+
+/* Bulk operations on arrays at least this long run without the GVL */
+static long nogvl_threshold = 10000;
+
+/* Call a handler with one argument. A Proc is called directly, without the
+ * method dispatch of rb_funcall; any other object is sent call.
+ */
+static VALUE
+call_handler(VALUE handler, VALUE arg)
+{
+  if (rb_obj_is_proc(handler))
+    return rb_proc_call_with_block(handler, 1, &arg, Qnil);
+  return rb_funcall(handler, id_call, 1, arg);
+}
+
+/* The bytes hashed for a key. Strings, and objects with to_str, give their
+ * contents. Integers and Symbols are hashed without allocating a String:
+ *
+ * - an Integer in the signed 64-bit range as its 8-byte little-endian two's
+ *   complement, and a larger one as its little-endian two's complement in
+ *   one byte more than its magnitude needs;
+ * - a Symbol as its name, so :foo and "foo" are the same key.
+ *
+ * Like the hash engines, these encodings are the same on every platform and
+ * must not change, since dumped filters depend on them.
+ */
+#define KEY_INLINE_BYTES 32
+
+struct filter_key {
+  const char *ptr;
+  long len;
+  VALUE str;
+  char buf[KEY_INLINE_BYTES];
+};
+
+/* Keys that get_key turns into bytes without calling back into Ruby */
+#define KEY_IS_DIRECT(obj) \
+  (RB_TYPE_P(obj, T_STRING) || RB_INTEGER_TYPE_P(obj) || SYMBOL_P(obj))
+
+static void
+get_key(VALUE obj, struct filter_key *key)
+{
+  const int flags = INTEGER_PACK_LITTLE_ENDIAN | INTEGER_PACK_2COMP;
+  uint64_t v;
+  size_t nbytes;
+  int i, sign, nlz;
+
+  key->str = Qnil;
+  if (FIXNUM_P(obj)) {
+    v = (uint64_t)(int64_t)FIX2LONG(obj);
+    for (i = 0; i < 8; ++i) key->buf[i] = (char)(v >> (8 * i));
+    key->ptr = key->buf;
+    key->len = 8;
+    return;
+  }
+  if (RB_TYPE_P(obj, T_BIGNUM)) {
+    key->ptr = key->buf;
+    key->len = 8;
+    sign = rb_integer_pack(obj, key->buf, 1, 8, 0, flags);
+    nbytes = rb_absint_size(obj, &nlz);
+    /* rb_integer_pack only reports overflow of the magnitude; the sign bit
+     * of the 8 bytes must also be right
+     */
+    if (nbytes < 8 || (nbytes == 8 && (nlz > 0 || (sign < 0 && rb_absint_singlebit_p(obj)))))
+      return;
+
+    nbytes += 1;
+    if (nbytes > KEY_INLINE_BYTES) {
+      key->str = rb_str_new(0, nbytes);
+      key->ptr = RSTRING_PTR(key->str);
+    }
+    rb_integer_pack(obj, (void *)key->ptr, nbytes, 1, 0, flags);
+    key->len = (long)nbytes;
+    return;
+  }
+
+  key->str = SYMBOL_P(obj) ? rb_sym2str(obj) : obj;
+  StringValue(key->str);
+  key->ptr = RSTRING_PTR(key->str);
+  key->len = RSTRING_LEN(key->str);
+}
+
+/* A BloomFilter::Digest: the digest of a key, made once by BloomFilter.digest
+ * and usable in place of the key by any filter of the same hash engine (and,
+ * for a keyed engine, the same hash_key).
+ */
+struct key_digest {
+  struct string_digest digest;
+  unsigned int engine;
+  uint8_t hashkey[HASH_KEY_SIZE];
+};
+
+static const rb_data_type_t digest_type = {
+  "bloom_filter_digest",
+  {
+    0,
+    RUBY_TYPED_DEFAULT_FREE,
+    0,
+  },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | FILTER_TYPED_SHAREABLE
+};
+
+#define DIGEST_P(obj) rb_typeddata_is_kind_of((obj), &digest_type)
+
+/* Whether obj is a digest that a filter of engine and hashkey can use */
+static int
+digest_usable(VALUE obj, unsigned int engine, const uint8_t *hashkey)
+{
+  const struct key_digest *kd;
+
+  if (!DIGEST_P(obj)) return 0;
+  kd = RTYPEDDATA_DATA(obj);
+  return kd->engine == engine &&
+    (!HASH_ENGINE_KEYED(engine) || memcmp(kd->hashkey, hashkey, HASH_KEY_SIZE) == 0);
+}
+
+/* The digest of a key, for a filter of engine and hashkey. A digest object
+ * is used as it is, when it was made with the same engine and key.
+ */
+static void
+get_digest(VALUE obj, unsigned int engine, const uint8_t *hashkey, struct string_digest *digest)
+{
+  struct filter_key key;
+
+  if (DIGEST_P(obj)) {
+    if (!digest_usable(obj, engine, hashkey))
+      rb_raise(rb_eArgError, "digest was made with a different hash engine or hash_key");
+    *digest = ((const struct key_digest *)RTYPEDDATA_DATA(obj))->digest;
+    return;
+  }
+
+  get_key(obj, &key);
+  digest_funcs[engine](key.ptr, key.len, hashkey, digest);
+}
+
+/* Bulk insertion: keys are hashed into a window of digests and the target
+ * words prefetched, and the bits are set once the window is full. By then
+ * the first prefetches have had the hashing of the rest of the window to
+ * complete.
+ */
+struct filter_batch {
+  struct filter *filter;
+  int count;
+  struct string_digest digests[BLOOM_BATCH];
+};
+
+static void
+batch_flush(struct filter_batch *batch)
+{
+  int i;
+
+  if (batch->count == 0) return;
+  for (i = 0; i < batch->count; ++i) {
+    bloom_set_digest(&batch->filter->bloom, &batch->digests[i]);
+  }
+  STATS_ADD(batch->filter, adds, batch->count);
+  STATS_ADD(batch->filter, batches, 1);
+  batch->count = 0;
+}
+
+static void
+batch_add(struct filter_batch *batch, VALUE obj)
+{
+  struct filter *filter = batch->filter;
+  struct string_digest *digest;
+
+  /* to_str, or a digest of another engine, may raise; don't lose the keys
+   * already in the window
+   */
+  if (!KEY_IS_DIRECT(obj) && !digest_usable(obj, filter->bloom.engine, filter->bloom.hashkey))
+    batch_flush(batch);
+
+  digest = &batch->digests[batch->count];
+  FILTER_GET_DIGEST(filter, obj, digest);
+  bloom_prefetch_digest(&batch->filter->bloom, digest, BLOOM_PREFETCH_WRITE);
+
+  if (++batch->count == BLOOM_BATCH) batch_flush(batch);
+}
+
+static VALUE
+add_all_i(RB_BLOCK_CALL_FUNC_ARGLIST(item, ptr))
+{
+  batch_add((struct filter_batch *)ptr, item);
+  return Qnil;
+}
+
+/* Large arrays are processed without the GVL, so that other threads can
+ * run while the filter is built or queried. The keys of a chunk are first
+ * copied into a buffer owned by this call, since other threads may modify
+ * the strings as soon as the GVL is released.
+ */
+struct key_chunk {
+  struct filter *filter;
+  const char *bytes;
+  const size_t *offsets;
+  const struct string_digest *digests;
+  long count;
+  char *found;
+};
+
+/* Copy up to max keys starting at items[start] into buf, recording the start
+ * of each key (and the end of the last) in offsets. Copying stops before a
+ * key that needs to_str, so that it only raises once the keys before it have
+ * been dealt with.
+ */
+static long
+copy_keys(VALUE items, long start, long max, VALUE buf, size_t *offsets)
+{
+  struct filter_key key;
+  VALUE obj;
+  long i;
+
+  rb_str_set_len(buf, 0);
+  for (i = 0; i < max && start + i < RARRAY_LEN(items); ++i) {
+    obj = RARRAY_AREF(items, start + i);
+    if (i > 0 && !KEY_IS_DIRECT(obj)) break;
+
+    get_key(obj, &key);
+    offsets[i] = RSTRING_LEN(buf);
+    rb_str_cat(buf, key.ptr, key.len);
+  }
+  offsets[i] = RSTRING_LEN(buf);
+
+  return i;
+}
+
+/* Copy a run of up to max digest objects starting at items[start] into buf.
+ * As with copy_keys, a digest the filter can't use only raises at the start
+ * of a run.
+ */
+static long
+copy_digests(struct filter *filter, VALUE items, long start, long max, VALUE buf)
+{
+  struct string_digest digest;
+  VALUE obj;
+  long i;
+
+  rb_str_set_len(buf, 0);
+  for (i = 0; i < max && start + i < RARRAY_LEN(items); ++i) {
+    obj = RARRAY_AREF(items, start + i);
+    if (i > 0 && !digest_usable(obj, filter->bloom.engine, filter->bloom.hashkey)) break;
+
+    get_digest(obj, filter->bloom.engine, filter->bloom.hashkey, &digest);
+    rb_str_cat(buf, (const char *)&digest, sizeof(digest));
+  }
+
+  return i;
+}
+
+/* Fill a chunk from items[start]: a run of digest objects, or of keys */
+static void
+copy_chunk(struct key_chunk *chunk, VALUE items, long start, VALUE buf, size_t *offsets)
+{
+  if (DIGEST_P(RARRAY_AREF(items, start))) {
+    chunk->count = copy_digests(chunk->filter, items, start, NOGVL_CHUNK, buf);
+    chunk->digests = (const struct string_digest *)RSTRING_PTR(buf);
+  }
+  else {
+    chunk->count = copy_keys(items, start, NOGVL_CHUNK, buf, offsets);
+    chunk->bytes = RSTRING_PTR(buf);
+    chunk->digests = 0;
+  }
+}
+
+static void *
+add_keys_nogvl(void *ptr)
+{
+  struct key_chunk *chunk = ptr;
+
+  if (chunk->digests)
+    bloom_add_digests(&chunk->filter->bloom, chunk->digests, chunk->count);
+  else
+    bloom_add_keys(&chunk->filter->bloom, chunk->bytes, chunk->offsets, chunk->count);
+  return 0;
+}
+
+static void *
+query_keys_nogvl(void *ptr)
+{
+  struct key_chunk *chunk = ptr;
+
+  if (chunk->digests)
+    bloom_query_digests(&chunk->filter->bloom, chunk->digests, chunk->count, chunk->found);
+  else
+    bloom_query_keys(&chunk->filter->bloom, chunk->bytes, chunk->offsets, chunk->count,
+                     chunk->found);
+  return 0;
+}
+
+static void
+add_all_nogvl(struct filter *filter, VALUE items)
+{
+  struct key_chunk chunk;
+  size_t *offsets;
+  long start;
+  VALUE buf = rb_str_buf_new(0), tmp;
+
+  offsets = ALLOCV_N(size_t, tmp, NOGVL_CHUNK + 1);
+  chunk.filter = filter;
+  chunk.offsets = offsets;
+  chunk.found = 0;
+
+  for (start = 0; start < RARRAY_LEN(items); start += chunk.count) {
+    copy_chunk(&chunk, items, start, buf, offsets);
+    rb_thread_call_without_gvl(add_keys_nogvl, &chunk, 0, 0);
+    STATS_ADD(filter, adds, chunk.count);
+    STATS_ADD(filter, batches, BATCH_COUNT(chunk.count));
+  }
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(buf);
+}
+
+static void
+add_all(struct filter *filter, VALUE items)
+{
+  struct filter_batch batch;
+  long i;
+
+  FILTER_CHECK_WRITABLE(filter);
+  batch.filter = filter;
+  batch.count = 0;
+
+  if (RB_TYPE_P(items, T_ARRAY) && RARRAY_LEN(items) >= nogvl_threshold) {
+    add_all_nogvl(filter, items);
+  }
+  else if (RB_TYPE_P(items, T_ARRAY)) {
+    for (i = 0; i < RARRAY_LEN(items); ++i) {
+      batch_add(&batch, RARRAY_AREF(items, i));
+    }
+  }
+  else {
+    rb_block_call(items, id_each, 0, 0, add_all_i, (VALUE)&batch);
+  }
+
+  batch_flush(&batch);
+}
+
+/* Bulk queries use the same window: hash and prefetch up to BLOOM_BATCH
+ * items, then test them while the rest of the window's loads are in flight.
+ */
+enum query_mode {
+  QUERY_BOOLEANS,
+  QUERY_BITMAP,
+  QUERY_SELECT,
+  QUERY_REJECT
+};
+
+static int
+query_window(struct filter *filter, VALUE items, long start, VALUE *window, char *found)
+{
+  struct string_digest digests[BLOOM_BATCH];
+  int i, n;
+
+  n = (int)(RARRAY_LEN(items) - start);
+  if (n > BLOOM_BATCH) n = BLOOM_BATCH;
+
+  for (i = 0; i < n; ++i) {
+    window[i] = RARRAY_AREF(items, start + i);
+    FILTER_GET_DIGEST(filter, window[i], &digests[i]);
+    bloom_prefetch_digest(&filter->bloom, &digests[i], BLOOM_PREFETCH_READ);
+  }
+  for (i = 0; i < n; ++i) {
+    found[i] = bloom_get_digest(&filter->bloom, &digests[i]);
+  }
+
+  return n;
+}
+
+/* Like query_window, for up to NOGVL_CHUNK items at a time. The items are
+ * returned in an array, since the handler may modify the original.
+ */
+static long
+query_chunk_nogvl(struct filter *filter, VALUE items, long start, VALUE buf,
+                  size_t *offsets, VALUE *window, char *found)
+{
+  struct key_chunk chunk;
+
+  chunk.filter = filter;
+  chunk.offsets = offsets;
+  chunk.found = found;
+  copy_chunk(&chunk, items, start, buf, offsets);
+  *window = rb_ary_subseq(items, start, chunk.count);
+  rb_thread_call_without_gvl(query_keys_nogvl, &chunk, 0, 0);
+
+  return chunk.count;
+}
+
+static VALUE
+query_all(struct filter *filter, VALUE items, enum query_mode mode)
+{
+  char batch_found[BLOOM_BATCH], *found = batch_found, *bitmap = 0;
+  long start, len, i, n;
+  int nogvl;
+  size_t *offsets = 0;
+  VALUE batch_window[BLOOM_BATCH], window = Qnil, item, result, buf = Qnil, tmp = 0;
+  VALUE handler = filter->block, positives = Qnil;
+
+  FILTER_CHECK(filter);
+  items = rb_Array(items);
+  len = RARRAY_LEN(items);
+
+  nogvl = len >= nogvl_threshold;
+  if (nogvl) {
+    buf = rb_str_buf_new(0);
+    offsets = ALLOCV(tmp, (NOGVL_CHUNK + 1) * sizeof(size_t) + NOGVL_CHUNK);
+    found = (char *)(offsets + NOGVL_CHUNK + 1);
+  }
+
+  if (mode == QUERY_BITMAP) {
+    result = rb_str_new(0, (len + 7) / 8);
+    bitmap = RSTRING_PTR(result);
+    memset(bitmap, 0, (len + 7) / 8);
+  }
+  else {
+    result = rb_ary_new_capa(mode == QUERY_BOOLEANS ? len : 0);
+  }
+  if (filter->batch_handler && !NIL_P(handler)) {
+    positives = rb_ary_new();
+  }
+
+  for (start = 0; start < RARRAY_LEN(items); start += n) {
+    if (nogvl) {
+      n = query_chunk_nogvl(filter, items, start, buf, offsets, &window, found);
+    }
+    else {
+      n = query_window(filter, items, start, batch_window, found);
+    }
+    STATS_ADD(filter, queries, n);
+    STATS_ADD(filter, batches, BATCH_COUNT(n));
+    for (i = 0; i < n; ++i) {
+      item = nogvl ? RARRAY_AREF(window, i) : batch_window[i];
+      switch (mode) {
+      case QUERY_BOOLEANS:
+        rb_ary_push(result, found[i] ? Qtrue : Qfalse);
+        break;
+      case QUERY_BITMAP:
+        if (found[i] && start + i < len)
+          bitmap[(start + i) / 8] |= 1 << ((start + i) % 8);
+        break;
+      case QUERY_SELECT:
+        if (found[i]) rb_ary_push(result, item);
+        break;
+      case QUERY_REJECT:
+        if (!found[i]) rb_ary_push(result, item);
+        break;
+      }
+      if (!found[i]) continue;
+      STATS_ADD(filter, positives, 1);
+      if (!NIL_P(positives)) {
+        rb_ary_push(positives, item);
+      }
+      else if (!NIL_P(handler)) {
+        STATS_ADD(filter, handler_calls, 1);
+        call_handler(handler, item);
+      }
+    }
+  }
+  if (!NIL_P(positives) && RARRAY_LEN(positives) > 0) {
+    STATS_ADD(filter, handler_calls, 1);
+    call_handler(handler, positives);
+  }
+
+  if (nogvl) ALLOCV_END(tmp);
+  RB_GC_GUARD(buf);
+  RB_GC_GUARD(window);
+  return result;
+}
+
+static VALUE
+add_item(struct filter *filter, VALUE str)
+{
+  struct string_digest digest;
+
+  FILTER_CHECK_WRITABLE(filter);
+  FILTER_GET_DIGEST(filter, str, &digest);
+  bloom_set_digest(&filter->bloom, &digest);
+  STATS_ADD(filter, adds, 1);
+
+  return str;
+}
+
+static void
+filter_mark(void *ptr)
+{
+  struct filter *filter = ptr;
+  rb_gc_mark(filter->block);
+}
+
+static void
+filter_free(void *ptr)
+{
+  struct filter *filter = ptr;
+
+  if (filter->bitmem) xfree(filter->bitmem);
+#ifdef HAVE_SYS_MMAN_H
+  if (filter->map) munmap(filter->map, filter->maplen);
+#endif
+  xfree(filter);
+}
+
+static size_t
+filter_memsize(const void *ptr)
+{
+  const struct filter *filter = ptr;
+  size_t size = sizeof(struct filter);
+
+  /* a mapped bit array lives in the page cache, not the ruby heap */
+  if (filter->bitmem) {
+    size += sizeof(uint64_t) * (filter->bloom.arycapa + BLOOM_WORDS_PER_BLOCK);
+  }
+
+  return size;
+}
+
+static const rb_data_type_t filter_type = {
+  "bloom_filter",
+  {
+    filter_mark,
+    filter_free,
+    filter_memsize
+  },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | FILTER_TYPED_SHAREABLE
 };
 
-#define GET_ARYCAPA(n) (n / sizeof(size_t))
-#define BITS_PER_SIZE_T (sizeof(size_t) * 8)
-#define TOTAL_BITS(f) ((f)->arycapa * BITS_PER_SIZE_T)
-#define CHUNK(f, bit) ((f)->bitary[bit / BITS_PER_SIZE_T])
-#define BIT(bit) (1 << (bit % BITS_PER_SIZE_T))
+static VALUE
+filter_allocate(VALUE klass)
+{
+  struct filter *filter;
+  VALUE obj = TypedData_Make_Struct(klass, struct filter, &filter_type, filter);
+
+  bloom_init(&filter->bloom);
+  filter->capa    = 0;
+  filter->block   = Qnil;
+  filter->bitmem  = 0;
+  filter->map     = 0;
+  filter->maplen  = 0;
+  filter->readonly = 0;
+  filter->track_stats = 0;
+  memset(&filter->stats, 0, sizeof(filter->stats));
+  filter->batch_handler = 0;
+
+  return obj;
+}
+
+/* Allocate the bit array aligned to a block boundary, so that a block of the
+ * blocked layout never straddles two cache lines.
+ */
+static void
+filter_alloc_bits(struct filter *filter, size_t arycapa)
+{
+  filter->bloom.arycapa = arycapa;
+  if (arycapa == 0) return;
+
+  filter->bitmem = xcalloc(arycapa + BLOOM_WORDS_PER_BLOCK, sizeof(uint64_t));
+  filter->bloom.bitary = BLOOM_ALIGN_BITS(filter->bitmem);
+}
+
+static enum bloom_layout
+get_layout(VALUE sym)
+{
+  ID id;
+
+  if (!SYMBOL_P(sym))
+    rb_raise(rb_eTypeError, "layout must be a Symbol");
+
+  id = SYM2ID(sym);
+  if (id == id_standard) return BLOOM_LAYOUT_STANDARD;
+  if (id == id_blocked) return BLOOM_LAYOUT_BLOCKED;
+
+  rb_raise(rb_eArgError, "unknown layout: %"PRIsVALUE, sym);
+  UNREACHABLE;
+}
+
+static enum bloom_reduction
+get_reduction(VALUE sym)
+{
+  ID id;
+
+  if (!SYMBOL_P(sym))
+    rb_raise(rb_eTypeError, "reduction must be a Symbol");
+
+  id = SYM2ID(sym);
+  if (id == id_mask) return BLOOM_REDUCE_MASK;
+  if (id == id_fastrange) return BLOOM_REDUCE_FASTRANGE;
+
+  rb_raise(rb_eArgError, "unknown reduction: %"PRIsVALUE, sym);
+  UNREACHABLE;
+}
+
+static unsigned int
+get_engine(VALUE sym)
+{
+  ID id;
+
+  if (!SYMBOL_P(sym))
+    rb_raise(rb_eTypeError, "hash must be a Symbol");
+
+  id = SYM2ID(sym);
+  if (id == id_murmur3) return HASH_ENGINE_MURMUR3;
+  if (id == id_wyhash) return HASH_ENGINE_WYHASH;
+  if (id == id_siphash) return HASH_ENGINE_SIPHASH;
+
+  rb_raise(rb_eArgError, "unknown hash engine: %"PRIsVALUE, sym);
+  UNREACHABLE;
+}
+
+static VALUE
+layout_name(enum bloom_layout layout)
+{
+  switch (layout) {
+  case BLOOM_LAYOUT_BLOCKED:
+    return ID2SYM(id_blocked);
+  default:
+    return ID2SYM(id_standard);
+  }
+}
+
+static VALUE
+reduction_name(enum bloom_reduction reduction)
+{
+  switch (reduction) {
+  case BLOOM_REDUCE_MASK:
+    return ID2SYM(id_mask);
+  default:
+    return ID2SYM(id_fastrange);
+  }
+}
+
+static VALUE
+engine_name(unsigned int engine)
+{
+  switch (engine) {
+  case HASH_ENGINE_WYHASH:
+    return ID2SYM(id_wyhash);
+  case HASH_ENGINE_SIPHASH:
+    return ID2SYM(id_siphash);
+  default:
+    return ID2SYM(id_murmur3);
+  }
+}
+
+/* Set up the hash engine from the hash and hash_key options (Qundef when not
+ * given). Keyed engines get a random key unless one is given.
+ */
+static void
+get_hash_options(VALUE hash, VALUE hash_key, unsigned int *engine, uint8_t *key)
+{
+  if (hash != Qundef) *engine = get_engine(hash);
+  if (!HASH_ENGINE_KEYED(*engine)) {
+    if (hash_key != Qundef && !NIL_P(hash_key))
+      rb_raise(rb_eArgError, "hash_key is only used by keyed hash engines");
+    return;
+  }
+
+  if (hash_key == Qundef || NIL_P(hash_key))
+    hash_key = rb_funcall(rb_cRandom, id_urandom, 1, INT2FIX(HASH_KEY_SIZE));
+  StringValue(hash_key);
+  if (RSTRING_LEN(hash_key) != HASH_KEY_SIZE)
+    rb_raise(rb_eArgError, "hash_key must be %d bytes", HASH_KEY_SIZE);
+  memcpy(key, RSTRING_PTR(hash_key), HASH_KEY_SIZE);
+}
+
+#define filter_expected_fpr_at(f, n) \
+  bloom_expected_fpr((f)->bloom.layout, (double)TOTAL_BITS(f), (double)(f)->bloom.nhashes, \
+                     (double)(n))
+
+/* Work out the number of bits and hash functions for nitems from the
+ * fpr, bits_per_item, hashes, memory and reduction options (Qundef when not
+ * given).
+ * Returns the size of the bit array in 64-bit words. Options that would leave
+ * it empty raise ArgumentError here, rather than on the first add or query.
+ */
+static size_t
+filter_sizing(struct filter *filter, size_t nitems, VALUE fpr, VALUE bits_per_item,
+              VALUE hashes, VALUE memory, VALUE reduction)
+{
+  double n = (double)nitems, m, k = 0, p = 0, words;
+  size_t arycapa;
+
+  if ((fpr != Qundef) + (bits_per_item != Qundef) + (memory != Qundef) > 1)
+    rb_raise(rb_eArgError, "only one of fpr, bits_per_item and memory may be given");
+  if (nitems == 0 && memory == Qundef)
+    rb_raise(rb_eArgError, "capacity must be positive");
+
+  if (hashes != Qundef) {
+    k = NUM2UINT(hashes);
+    if (k < 1 || k > BLOOM_MAX_HASH_COUNT)
+      rb_raise(rb_eArgError, "hashes must be between 1 and %d", BLOOM_MAX_HASH_COUNT);
+  }
+
+  if (fpr != Qundef) {
+    p = NUM2DBL(fpr);
+    if (!(p > 0 && p < 1))
+      rb_raise(rb_eArgError, "fpr must be between 0 and 1");
+    if (k > 0) {
+      m = -k * n / log(1 - pow(p, 1 / k));
+    }
+    else {
+      m = -n * log(p) / (LN2 * LN2);
+    }
+  }
+  else if (bits_per_item != Qundef) {
+    if (!(NUM2DBL(bits_per_item) > 0))
+      rb_raise(rb_eArgError, "bits_per_item must be positive");
+    m = n * NUM2DBL(bits_per_item);
+  }
+  else if (memory != Qundef) {
+    m = (double)(NUM2SIZET(memory) / sizeof(uint64_t) * BLOOM_BITS_PER_WORD);
+  }
+  else {
+    /* the historical default: 8 bits per item and 3 hash functions */
+    m = n * DEFAULT_BITS_PER_ITEM;
+    if (k == 0) k = HASH_COUNT;
+  }
+
+  if (k == 0) {
+    k = n > 0 ? round(m / n * LN2) : HASH_COUNT;
+    if (k < 1) k = 1;
+    if (k > BLOOM_MAX_HASH_COUNT) k = BLOOM_MAX_HASH_COUNT;
+  }
+
+  /* Rounding k, and the uneven load of the blocked layout, can leave the
+   * rate slightly above the target; grow the array until it is met. The
+   * blocked rate is only defined for at least one whole block.
+   */
+  if (filter->bloom.layout == BLOOM_LAYOUT_BLOCKED && m > 0 && m < BLOOM_BITS_PER_BLOCK) {
+    m = BLOOM_BITS_PER_BLOCK;
+  }
+  if (p > 0) {
+    while (bloom_expected_fpr(filter->bloom.layout, m, k, n) > p) {
+      m = m * 1.01 + BLOOM_BITS_PER_BLOCK;
+    }
+  }
+
+  words = ceil(m / BLOOM_BITS_PER_WORD);
+  if (filter->bloom.layout == BLOOM_LAYOUT_BLOCKED) {
+    words = ceil(words / BLOOM_WORDS_PER_BLOCK) * BLOOM_WORDS_PER_BLOCK;
+  }
+  if (reduction == Qundef) {
+    /* mask whenever the size happens to allow it */
+    filter->bloom.reduction = words > 0 && words == pow(2, floor(log2(words))) ?
+      BLOOM_REDUCE_MASK : BLOOM_REDUCE_FASTRANGE;
+  }
+  else {
+    filter->bloom.reduction = get_reduction(reduction);
+    if (filter->bloom.reduction == BLOOM_REDUCE_MASK && words > 0) {
+      words = pow(2, ceil(log2(words)));
+      /* The extra bits are spent on fewer probes, not a lower rate: drop k
+       * as far as the requested fpr still allows.
+       */
+      if (hashes == Qundef && p > 0) {
+        m = words * BLOOM_BITS_PER_WORD;
+        while (k > 1 && bloom_expected_fpr(filter->bloom.layout, m, k - 1, n) <= p) --k;
+      }
+    }
+  }
+  if (words == 0)
+    rb_raise(rb_eArgError, "memory must be at least %d bytes", (int)sizeof(uint64_t));
+  if (words * sizeof(uint64_t) >= (double)SIZE_MAX / 2)
+    rb_raise(rb_eArgError, "bloom filter too large");
+
+  arycapa = (size_t)words;
+  filter->bloom.nhashes = (unsigned int)k;
+  return arycapa;
+}
+
+/*
+ * call-seq:
+ *   BloomFilter.new(capa)                     -> filter
+ *   BloomFilter.new(capa)  { |string| block } -> filter
+ *   BloomFilter.new(array)                    -> filter
+ *   BloomFilter.new(array) { |string| block } -> filter
+ *   BloomFilter.new(enum)                     -> filter
+ *   BloomFilter.new(enum)  { |string| block } -> filter
+ *   BloomFilter.new(capa, layout: :blocked)   -> filter
+ *   BloomFilter.new(capa, fpr: 0.001)         -> filter
+ *   BloomFilter.new(capa, bits_per_item: 12)  -> filter
+ *   BloomFilter.new(capa, memory: bytes)      -> filter
+ *   BloomFilter.new(capa, hashes: k, ...)     -> filter
+ *   BloomFilter.new(capa, reduction: :mask)   -> filter
+ *   BloomFilter.new(capa, track_fill: true)   -> filter
+ *   BloomFilter.new(capa, concurrent: true)   -> filter
+ *   BloomFilter.new(capa, hash: :wyhash)      -> filter
+ *   BloomFilter.new(capa, hash: :siphash, hash_key: key) -> filter
+ *   BloomFilter.new(capa, stats: true)        -> filter
+ *   BloomFilter.new(capa, batch_handler: true) { |array| block } -> filter
+ *
+ * Construct a new bloom filter.
+ *
+ * The argument <i>capa</i> is the desired capacity. This doesn't have to be the
+ * exact number of items to be stored in the set, but the more accurate this is,
+ * the more optimal the resulting bloom array in terms of false positive rate
+ * and memory usage.
+ *
+ * Instead of passing a capacity, an array can be passed in instead. In this case,
+ * the array length is used as the capacity, and item in the array is added to the
+ * filter.
+ *
+ * If the argument is not an array or a fixnum, then it must respond to
+ * <code>size</code> and <code>each</code>. The size method must return a fixnum,
+ * and each item yielded by <code>each</code> will be aded to the filter.
+ *
+ * If a block is given, it will be called by <code>filter.query</code> when a
+ * positive match is detected. The block can be set after initialization with
+ * <code>filter.handler=</code>.
+ *
+ * The <code>layout</code> option selects how an item's bits are placed in the
+ * bit array. The default, <code>:standard</code>, spreads them over the whole
+ * array. <code>:blocked</code> keeps all of them in one 64-byte block, so a
+ * query touches a single cache line however large the filter is, at the cost
+ * of a slightly higher false positive rate (see <code>expected_fpr</code>).
+ *
+ * By default the filter uses 8 bits per item and 3 hash functions. The size
+ * can instead be given as a target false positive rate (<code>fpr</code>), a
+ * number of bits per item (<code>bits_per_item</code>) or a total size of the
+ * bit array in bytes (<code>memory</code>); only one of these may be given.
+ * The optimal number of hash functions for the resulting size is used unless
+ * <code>hashes</code> is given. See <code>bit_count</code>,
+ * <code>hash_count</code> and <code>expected_fpr</code> for the result.
+ *
+ * Hash values are mapped onto the bit array with a bit mask when its size is
+ * a power of two, and with a multiply-high reduction otherwise. Passing
+ * <code>reduction: :mask</code> rounds the size up to a power of two, which
+ * makes each probe slightly cheaper at the cost of up to twice the memory.
+ * When sizing for <code>fpr</code>, the extra bits go towards fewer hash
+ * functions rather than a lower rate.
+ *
+ * With <code>track_fill: true</code>, the number of set bits is kept up to
+ * date as items are added, so that <code>bits_set</code>,
+ * <code>fill_ratio</code>, <code>estimated_count</code> and
+ * <code>current_fpr</code> don't have to scan the bit array. The count is not
+ * saved by <code>dump</code>.
+ *
+ * With <code>concurrent: true</code>, bits are set with an atomic OR, so
+ * several threads may run <code>add_all</code> on the same filter without
+ * the GVL, and without a lock, while others query it. No bit set by one
+ * thread is lost to another: once <code>add</code> or <code>add_all</code>
+ * has returned, a query ordered after it (by a join, a Queue, a Mutex or the
+ * GVL) finds every item that was added, so there are no false negatives. A
+ * query running at the same time as the add may or may not find the item.
+ * Setting a bit that is already set costs nothing extra; setting a clear one
+ * costs a locked instruction. <code>merge!</code> and
+ * <code>intersect!</code> are not atomic.
+ *
+ * The <code>hash</code> option picks the function that digests each string:
+ * <code>:murmur3</code> (the default, as in earlier versions),
+ * <code>:wyhash</code>, which is faster, or <code>:siphash</code>, which is
+ * keyed with the 16-byte string <code>hash_key</code> so that an attacker
+ * who doesn't know the key can't pick strings that all land on the same bits.
+ * A random key is used if none is given. The engine and key are saved by
+ * <code>dump</code>, so a dump of a keyed filter must be kept as private as
+ * its key.
+ *
+ * With <code>stats: true</code>, the filter counts the items added and
+ * queried, the positive answers, the calls of the handler and the prefetch
+ * windows of bulk operations; see <code>stats</code>.
+ *
+ * With <code>batch_handler: true</code>, the handler is called with an Array
+ * of positive matches rather than once per match: <code>query_all</code>,
+ * <code>select_present</code> and <code>reject_present</code> call it once,
+ * after the whole array has been tested, and <code>query</code> calls it with
+ * a one-item Array.
+ */
+static VALUE
+filter_initialize(int argc, VALUE *argv, VALUE obj)
+{
+  size_t nitems, arycapa;
+  struct filter *filter;
+  VALUE arg, opts, kwargs[12], tmp;
+  ID kwids[12];
+  int add_items = 0;
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  if (filter->bloom.bitary)
+    rb_raise(rb_eRuntimeError, "bloom filter already initialized");
+
+  rb_scan_args(argc, argv, "1:", &arg, &opts);
+
+  switch (TYPE(arg)) {
+  case T_FIXNUM:
+    nitems = NUM2SIZET(arg);
+    break;
+  case T_ARRAY:
+    add_items = 1;
+    nitems = RARRAY_LEN(arg);
+    break;
+  default:
+    add_items = 1;
+    tmp = rb_funcall(arg, id_size, 0, NULL);
+    if (!FIXNUM_P(tmp))
+      rb_raise(rb_eArgError, "Argument's size method returned an invalid size");
+    nitems = NUM2SIZET(tmp);
+  }
+
+
+  kwargs[0] = kwargs[1] = kwargs[2] = kwargs[3] = Qundef;
+  kwargs[4] = kwargs[5] = kwargs[6] = kwargs[7] = kwargs[8] = kwargs[9] = Qundef;
+  kwargs[10] = kwargs[11] = Qundef;
+  if (!NIL_P(opts)) {
+    kwids[0] = id_layout;
+    kwids[1] = id_fpr;
+    kwids[2] = id_bits_per_item;
+    kwids[3] = id_hashes;
+    kwids[4] = id_memory;
+    kwids[5] = id_reduction;
+    kwids[6] = id_track_fill;
+    kwids[7] = id_concurrent;
+    kwids[8] = id_hash;
+    kwids[9] = id_hash_key;
+    kwids[10] = id_stats;
+    kwids[11] = id_batch_handler;
+    rb_get_kwargs(opts, kwids, 0, 12, kwargs);
+    if (kwargs[0] != Qundef) filter->bloom.layout = get_layout(kwargs[0]);
+    if (kwargs[6] != Qundef) filter->bloom.track_fill = RTEST(kwargs[6]);
+    if (kwargs[7] != Qundef) filter->bloom.concurrent = RTEST(kwargs[7]);
+    if (kwargs[10] != Qundef) filter->track_stats = RTEST(kwargs[10]);
+    if (kwargs[11] != Qundef) filter->batch_handler = RTEST(kwargs[11]);
+#ifndef BLOOM_HAVE_ATOMICS
+    if (filter->bloom.concurrent)
+      rb_raise(rb_eNotImpError, "concurrent bloom filters need atomic operations");
+#endif
+    get_hash_options(kwargs[8], kwargs[9], &filter->bloom.engine, filter->bloom.hashkey);
+  }
+
+  /* nitems is the desired number of elements; we need to get the
+   * number of 64-bit words needed to hold the requested bits per item.
+   * The blocked layout is rounded up to a whole number of blocks.
+   */
+  arycapa = filter_sizing(filter, nitems, kwargs[1], kwargs[2], kwargs[3], kwargs[4],
+                          kwargs[5]);
+  filter->capa = nitems;
+  filter_alloc_bits(filter, arycapa);
+
+  /* deal with array and enum args */
+  if (add_items && filter->bloom.bitary) {
+    add_all(filter, arg);
+  }
+
+  /* store block */
+  if (rb_block_given_p()) {
+    RB_OBJ_WRITE(obj, &filter->block, rb_block_proc());
+  }
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.add(item)   -> filter
+ *   filter << item     -> filter
+ *
+ * Add an item to the filter. The item must be a String, an Integer, a Symbol,
+ * or an object that converts to a String with <code>to_str</code>; see the
+ * class documentation for how each is hashed.
+ */
+static VALUE
+filter_add_item(VALUE obj, VALUE item)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  rb_check_frozen(obj);
+
+  add_item(filter, item);
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.add_all(array)    -> filter
+ *   filter.add_all(enum)     -> filter
+ *
+ * Add every item of an array, or every item yielded by <code>each</code>, to
+ * the filter. This is equivalent to calling <code>add</code> for each item,
+ * but the loop runs in C: items are hashed a window at a time and the memory
+ * they will touch is prefetched before any bits are set, so the cache misses
+ * of one item overlap the hashing of the next. On filters larger than the
+ * last level cache this aims for at least three times the throughput of
+ * <code>items.each { |i| filter << i }</code>.
+ *
+ * Arrays of at least <code>BloomFilter.nogvl_threshold</code> items are
+ * processed without holding the GVL, so other threads keep running. Other
+ * threads may query the filter in the meantime, but should not add to it
+ * unless the filter was created with <code>concurrent: true</code>.
+ */
+static VALUE
+filter_add_all(VALUE obj, VALUE items)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  rb_check_frozen(obj);
+
+  add_all(filter, items);
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.include?(item)    -> Bool
+ *   filter.query(item)       -> Bool
+ *
+ * Test an item to see it it's in the filter. If a positive match is reported
+ * and the filter has a handler Proc, the proc will be called with the string
+ * object as the argument (with a one-item Array of it for a filter created
+ * with <code>batch_handler: true</code>).
+ */
+static VALUE
+filter_query_item(VALUE obj, VALUE str)
+{
+  struct filter *filter;
+  struct string_digest digest;
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  FILTER_GET_DIGEST(filter, str, &digest);
+  STATS_ADD(filter, queries, 1);
+  if (!bloom_get_digest(&filter->bloom, &digest)) {
+    return Qfalse;
+  }
+
+  STATS_ADD(filter, positives, 1);
+  if (!NIL_P(filter->block)) {
+    STATS_ADD(filter, handler_calls, 1);
+    call_handler(filter->block, filter->batch_handler ? rb_ary_new_from_values(1, &str) : str);
+  }
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   filter.query_all(array)                -> Array
+ *   filter.query_all(array, bitmap: true)  -> String
+ *
+ * Test every item of an array against the filter. Returns an array with
+ * <code>true</code> or <code>false</code> for each item or, with the
+ * <code>bitmap</code> option, a binary string in which bit <i>i</i> (least
+ * significant bit first in each byte) is set when item <i>i</i> may be in the
+ * filter.
+ *
+ * Items are hashed and their bits prefetched a window at a time, so the
+ * lookups for a window are in flight together. The handler Proc, if any, is
+ * called for each positive match as with <code>query</code>. Arrays of at
+ * least <code>BloomFilter.nogvl_threshold</code> items are tested without
+ * holding the GVL.
+ */
+static VALUE
+filter_query_all(int argc, VALUE *argv, VALUE obj)
+{
+  struct filter *filter;
+  VALUE items, opts, bitmap = Qundef;
+  ID kwid;
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  rb_scan_args(argc, argv, "1:", &items, &opts);
+  if (!NIL_P(opts)) {
+    kwid = id_bitmap;
+    rb_get_kwargs(opts, &kwid, 0, 1, &bitmap);
+  }
+
+  return query_all(filter, items,
+                   bitmap != Qundef && RTEST(bitmap) ? QUERY_BITMAP : QUERY_BOOLEANS);
+}
+
+/*
+ * call-seq:
+ *   filter.select_present(array)   -> Array
+ *
+ * Get the items of an array that may be in the filter. This is equivalent to
+ * <code>array.select { |i| filter.query(i) }</code>, without calling back into
+ * Ruby for each item.
+ */
+static VALUE
+filter_select_present(VALUE obj, VALUE items)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return query_all(filter, items, QUERY_SELECT);
+}
+
+/*
+ * call-seq:
+ *   filter.reject_present(array)   -> Array
+ *
+ * Get the items of an array that are definitely not in the filter. This is
+ * equivalent to <code>array.reject { |i| filter.query(i) }</code>, without
+ * calling back into Ruby for each item.
+ */
+static VALUE
+filter_reject_present(VALUE obj, VALUE items)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return query_all(filter, items, QUERY_REJECT);
+}
+
+/*
+ * call-seq:
+ *   filter.handler       -> Proc or nil
+ *
+ * Get the handler Proc.
+ */
+static VALUE
+filter_handler(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return filter->block;
+}
+
+/*
+ * call-seq:
+ *   filter.handler = proc or nil   -> proc or nil
+ *
+ * Set the handler Proc. Note that we don't do type or arity checks on the Proc,
+ * so setting a bogus object as the handler will cause an error to get thrown
+ * when a positive match is found. A Proc is called directly; any other
+ * handler must respond to <code>call</code>, which costs a method dispatch
+ * per match.
+ */
+static VALUE
+filter_set_handler(VALUE obj, VALUE handler)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  rb_check_frozen(obj);
+
+  RB_OBJ_WRITE(obj, &filter->block, handler);
+  return handler;
+}
+
+/*
+ * call-seq:
+ *   filter.size      -> Number
+ *   filter.length    -> Number
+ *
+ * Get the length of the underlying bit array in bytes.
+ */
+static VALUE
+filter_size(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  return SIZET2NUM(filter->bloom.arycapa * sizeof(uint64_t));
+}
+
+/*
+ * call-seq:
+ *   filter.layout      -> :standard or :blocked
+ *
+ * Get the bit layout the filter was created with.
+ */
+static VALUE
+filter_layout(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return layout_name(filter->bloom.layout);
+}
+
+/*
+ * call-seq:
+ *   filter.reduction   -> :mask or :fastrange
+ *
+ * Get the way hash values are mapped onto the bit array: <code>:mask</code>
+ * when its size is a power of two, otherwise <code>:fastrange</code>.
+ */
+static VALUE
+filter_reduction(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return reduction_name(filter->bloom.reduction);
+}
+
+/*
+ * call-seq:
+ *   filter.expected_fpr    -> Float
+ *
+ * Get the theoretical false positive rate of the filter once it holds the
+ * capacity it was created with, given its <code>bit_count</code> and
+ * <code>hash_count</code>. For the blocked layout this accounts for the
+ * uneven load of the blocks, and is slightly higher than for the standard
+ * layout with the same size.
+ */
+static VALUE
+filter_expected_fpr(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return DBL2NUM(filter_expected_fpr_at(filter, filter->capa));
+}
+
+/*
+ * call-seq:
+ *   filter.hash_engine   -> :murmur3, :wyhash or :siphash
+ *
+ * Get the hash engine the filter was created with.
+ */
+static VALUE
+filter_hash_engine(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return engine_name(filter->bloom.engine);
+}
+
+/*
+ * call-seq:
+ *   filter.hash_key   -> String or nil
+ *
+ * Get the key of a keyed hash engine, or nil. Filters that are to be merged
+ * must share their key.
+ */
+static VALUE
+filter_hash_key(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  if (!HASH_ENGINE_KEYED(filter->bloom.engine)) return Qnil;
+  return rb_str_new((const char *)filter->bloom.hashkey, HASH_KEY_SIZE);
+}
+
+/*
+ * call-seq:
+ *   filter.concurrent?   -> Bool
+ *
+ * Whether bits are set atomically; see <code>BloomFilter.new</code>.
+ */
+static VALUE
+filter_concurrent_p(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return filter->bloom.concurrent ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   filter.batch_handler?   -> Bool
+ *
+ * Whether the handler is called with an Array of matches; see
+ * <code>BloomFilter.new</code>.
+ */
+static VALUE
+filter_batch_handler_p(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return filter->batch_handler ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   filter.stats    -> Hash or nil
+ *
+ * Get the operational counters of a filter created with
+ * <code>stats: true</code>, or nil for other filters. The Hash has
+ *
+ * [:adds]          items added
+ * [:queries]       items queried, singly or in bulk
+ * [:positives]     queries that answered true
+ * [:handler_calls] calls of the handler Proc
+ * [:batches]       prefetch windows of up to 16 items processed by
+ *                  <code>add_all</code> and the bulk queries
+ *
+ * When the queries are for items that were never added, positives / queries
+ * is the observed false positive rate, to compare with
+ * <code>current_fpr</code>. The counters are copied by <code>dup</code> but
+ * not saved by <code>dump</code>.
+ */
+static VALUE
+filter_stats(VALUE obj)
+{
+  struct filter *filter;
+  VALUE hash;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  if (!filter->track_stats) return Qnil;
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(id_adds), ULL2NUM(filter->stats.adds));
+  rb_hash_aset(hash, ID2SYM(id_queries), ULL2NUM(filter->stats.queries));
+  rb_hash_aset(hash, ID2SYM(id_positives), ULL2NUM(filter->stats.positives));
+  rb_hash_aset(hash, ID2SYM(id_handler_calls), ULL2NUM(filter->stats.handler_calls));
+  rb_hash_aset(hash, ID2SYM(id_batches), ULL2NUM(filter->stats.batches));
+  return hash;
+}
+
+/*
+ * call-seq:
+ *   filter.reset_stats    -> filter
+ *
+ * Set the counters returned by <code>stats</code> back to zero.
+ */
+static VALUE
+filter_reset_stats(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  rb_check_frozen(obj);
+
+  memset(&filter->stats, 0, sizeof(filter->stats));
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.bit_count     -> Number
+ *
+ * Get the number of bits in the filter's bit array.
+ */
+static VALUE
+filter_bit_count(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  return ULL2NUM(TOTAL_BITS(filter));
+}
+
+/*
+ * call-seq:
+ *   filter.hash_count    -> Number
+ *
+ * Get the number of bits set for each item added to the filter.
+ */
+static VALUE
+filter_hash_count(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  return UINT2NUM(filter->bloom.nhashes);
+}
+
+/* The hash and hash_key options of BloomFilter.hash_values and
+ * BloomFilter.digest. Unlike for new, a keyed engine needs a key.
+ */
+static void
+get_key_hash_options(VALUE opts, unsigned int *engine, uint8_t *hashkey)
+{
+  VALUE kwargs[2];
+  ID kwids[2];
+
+  kwargs[0] = kwargs[1] = Qundef;
+  if (!NIL_P(opts)) {
+    kwids[0] = id_hash;
+    kwids[1] = id_hash_key;
+    rb_get_kwargs(opts, kwids, 0, 2, kwargs);
+    if (kwargs[0] != Qundef && HASH_ENGINE_KEYED(get_engine(kwargs[0])) &&
+        (kwargs[1] == Qundef || NIL_P(kwargs[1])))
+      rb_raise(rb_eArgError, "hash_key is needed by keyed hash engines");
+  }
+  get_hash_options(kwargs[0], kwargs[1], engine, hashkey);
+}
+
+/*
+ * call-seq:
+ *   BloomFilter.hash_values(key)          -> Array
+ *   BloomFilter.hash_values(key, count)   -> Array
+ *   BloomFilter.hash_values(key, count, hash: :siphash, hash_key: key) -> Array
+ *
+ * For a given key, get an array containing the hash values used to probe the
+ * bloom filter. The values are derived from a single 128-bit digest of the
+ * key's bytes (see the class documentation for Integer and Symbol keys), so
+ * the nth value is <code>h1 + n * h2</code> modulo 2**64.
+ * <i>count</i> defaults to 3, the default <code>hash_count</code>. The
+ * <code>hash</code> and <code>hash_key</code> options are as for
+ * <code>BloomFilter.new</code>, except that a keyed engine needs a key.
+ */
+static VALUE
+filter_hash_values(int argc, VALUE *argv, VALUE klass)
+{
+  uint64_t hash;
+  unsigned int count = HASH_COUNT;
+  struct string_digest digest;
+  unsigned int engine = HASH_ENGINE_MURMUR3;
+  uint8_t hashkey[HASH_KEY_SIZE];
+  VALUE str, vcount, ary, opts;
+
+  rb_scan_args(argc, argv, "11:", &str, &vcount, &opts);
+  get_key_hash_options(opts, &engine, hashkey);
+  if (!NIL_P(vcount)) {
+    count = NUM2UINT(vcount);
+    if (count > BLOOM_MAX_HASH_COUNT)
+      rb_raise(rb_eArgError, "count must be at most %d", BLOOM_MAX_HASH_COUNT);
+  }
+
+  ary = rb_ary_new_capa(count);
+  get_digest(str, engine, hashkey, &digest);
+  HASH_ITERATE(&digest, count, hash, {
+    rb_ary_push(ary, ULL2NUM(hash));
+  });
+
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   BloomFilter.digest(key)                                 -> digest
+ *   BloomFilter.digest(key, hash: :siphash, hash_key: key)  -> digest
+ *
+ * Hash a key once, for checking it against many filters. The frozen
+ * BloomFilter::Digest returned can be given in place of the key to
+ * <code>add</code>, <code>query</code> and the bulk methods of any filter
+ * with the same hash engine (and <code>hash_key</code>), including
+ * BloomFilter::Scalable and BloomFilter::Counting, which use murmur3. Other
+ * filters raise ArgumentError. The options are as for
+ * <code>BloomFilter.hash_values</code>.
+ *
+ *    digest = BloomFilter.digest(user_id)
+ *    filters.select { |filter| filter.include?(digest) }
+ */
+static VALUE
+filter_digest(int argc, VALUE *argv, VALUE klass)
+{
+  struct key_digest *kd;
+  VALUE str, opts, obj;
+
+  rb_scan_args(argc, argv, "1:", &str, &opts);
+  obj = TypedData_Make_Struct(cDigest, struct key_digest, &digest_type, kd);
+  kd->engine = HASH_ENGINE_MURMUR3;
+  get_key_hash_options(opts, &kd->engine, kd->hashkey);
+  get_digest(str, kd->engine, kd->hashkey, &kd->digest);
+
+  return rb_obj_freeze(obj);
+}
+
+/*
+ * call-seq:
+ *   digest.hash_engine   -> :murmur3, :wyhash or :siphash
+ *
+ * Get the hash engine the digest was made with.
+ */
+static VALUE
+digest_hash_engine(VALUE obj)
+{
+  struct key_digest *kd;
+  TypedData_Get_Struct(obj, struct key_digest, &digest_type, kd);
+
+  return engine_name(kd->engine);
+}
+
+/*
+ * call-seq:
+ *   digest == other    -> Bool
+ *   digest.eql?(other) -> Bool
+ *
+ * Digests are equal when they hash the same key with the same engine and
+ * <code>hash_key</code>.
+ */
+static VALUE
+digest_equal(VALUE obj, VALUE other)
+{
+  struct key_digest *kd, *okd;
+  TypedData_Get_Struct(obj, struct key_digest, &digest_type, kd);
+
+  if (!DIGEST_P(other)) return Qfalse;
+  okd = RTYPEDDATA_DATA(other);
+  return kd->digest.h1 == okd->digest.h1 && kd->digest.h2 == okd->digest.h2 &&
+    digest_usable(other, kd->engine, kd->hashkey) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   digest.hash   -> Integer
+ *
+ * A hash code, so that digests can be Hash keys.
+ */
+static VALUE
+digest_hash(VALUE obj)
+{
+  struct key_digest *kd;
+  TypedData_Get_Struct(obj, struct key_digest, &digest_type, kd);
+
+  return ST2FIX(rb_memhash(&kd->digest, sizeof(kd->digest)) ^ kd->engine);
+}
+
+/*
+ * call-seq:
+ *   BloomFilter.nogvl_threshold   -> Integer or nil
+ *
+ * Get the array length from which <code>add_all</code>,
+ * <code>query_all</code>, <code>select_present</code> and
+ * <code>reject_present</code> release the GVL while hashing and touching the
+ * bit array. Below it, the cost of copying the keys out of their strings and
+ * switching threads outweighs the benefit.
+ */
+static VALUE
+filter_nogvl_threshold(VALUE klass)
+{
+  return nogvl_threshold == LONG_MAX ? Qnil : LONG2NUM(nogvl_threshold);
+}
+
+/* Process-wide settings are read by every Ractor without a lock, so only the
+ * main Ractor may change them.
+ */
+static void
+check_main_ractor(const char *name)
+{
+#ifdef RB_EXT_RACTOR_SAFE
+  VALUE ractor = rb_path2class("Ractor");
+
+  if (!RTEST(rb_equal(rb_funcall(ractor, id_current, 0), rb_funcall(ractor, id_main, 0))))
+    rb_raise(rb_path2class("Ractor::IsolationError"),
+             "%s can only be set from the main Ractor", name);
+#endif
+}
+
+/*
+ * call-seq:
+ *   BloomFilter.nogvl_threshold = n or nil   -> n or nil
+ *
+ * Set the array length from which bulk operations release the GVL. Setting it
+ * to nil keeps the GVL for every operation. The threshold is shared by the
+ * whole process, so it can only be set from the main Ractor.
+ */
+static VALUE
+filter_set_nogvl_threshold(VALUE klass, VALUE n)
+{
+  check_main_ractor("nogvl_threshold");
+  if (NIL_P(n)) {
+    nogvl_threshold = LONG_MAX;
+  }
+  else {
+    nogvl_threshold = NUM2LONG(n);
+    if (nogvl_threshold < 0)
+      rb_raise(rb_eArgError, "threshold must not be negative");
+  }
+
+  return n;
+}
+
+struct popcount_job {
+  const uint64_t *words;
+  size_t nwords;
+  uint64_t count;
+};
+
+static void *
+popcount_nogvl(void *ptr)
+{
+  struct popcount_job *job = ptr;
+
+  job->count = bloom_popcount(job->words, job->nwords);
+  return 0;
+}
+
+/* Number of set bits in the filter: kept as items are added when the filter
+ * was created with track_fill, otherwise counted.
+ */
+static uint64_t
+filter_bits_set(struct filter *filter)
+{
+  struct popcount_job job;
+
+  FILTER_CHECK(filter);
+  if (filter->bloom.track_fill) return filter->bloom.nset;
+
+  job.words = filter->bloom.bitary;
+  job.nwords = filter->bloom.arycapa;
+  if (filter->bloom.arycapa >= WORDS_NOGVL_THRESHOLD) {
+    rb_thread_call_without_gvl(popcount_nogvl, &job, 0, 0);
+  }
+  else {
+    popcount_nogvl(&job);
+  }
+  return job.count;
+}
+
+/* Swamidass-Baldi: with X of m bits set by k hash functions, the filter holds
+ * about -m/k * ln(1 - X/m) distinct items.
+ */
+static double
+filter_estimated_count(struct filter *filter, uint64_t nset)
+{
+  double m = (double)TOTAL_BITS(filter);
+
+  if (nset >= TOTAL_BITS(filter)) return HUGE_VAL;
+  return -m / filter->bloom.nhashes * log(1 - nset / m);
+}
+
+/*
+ * call-seq:
+ *   filter.bits_set    -> Number
+ *
+ * Get the number of bits set in the bit array. This is counted with a
+ * vectorized popcount, taking about as long as reading the bit array, unless
+ * the filter was created with <code>track_fill: true</code>, in which case
+ * it is kept up to date as items are added.
+ */
+static VALUE
+filter_bits_set_m(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return ULL2NUM(filter_bits_set(filter));
+}
+
+/*
+ * call-seq:
+ *   filter.fill_ratio    -> Float
+ *
+ * Get the fraction of the bits that are set. A filter with the optimal
+ * number of hash functions is about half full at its capacity.
+ */
+static VALUE
+filter_fill_ratio(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return DBL2NUM((double)filter_bits_set(filter) / TOTAL_BITS(filter));
+}
+
+/*
+ * call-seq:
+ *   filter.estimated_count    -> Float
+ *
+ * Estimate the number of distinct items added to the filter from the
+ * number of bits set (Swamidass and Baldi). The estimate is
+ * <code>Float::INFINITY</code> once every bit is set. For the blocked layout
+ * it is slightly low, since items in a crowded block share more bits.
+ */
+static VALUE
+filter_estimated_count_m(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return DBL2NUM(filter_estimated_count(filter, filter_bits_set(filter)));
+}
+
+/*
+ * call-seq:
+ *   filter.current_fpr    -> Float
+ *
+ * Estimate the false positive rate of the filter as it is now, rather than
+ * at its capacity (see <code>expected_fpr</code>). For the standard layout
+ * this is the fill ratio to the power of the number of hash functions; for
+ * the blocked layout it is the expected rate at the estimated count.
+ */
+static VALUE
+filter_current_fpr(VALUE obj)
+{
+  struct filter *filter;
+  uint64_t nset;
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  nset = filter_bits_set(filter);
+
+  switch (filter->bloom.layout) {
+  case BLOOM_LAYOUT_BLOCKED:
+    if (nset >= TOTAL_BITS(filter)) return DBL2NUM(1.0);
+    return DBL2NUM(filter_expected_fpr_at(filter, filter_estimated_count(filter, nset)));
+  default:
+    return DBL2NUM(pow((double)nset / TOTAL_BITS(filter), filter->bloom.nhashes));
+  }
+}
+
+/* measure_fpr probes keys of 16 random bytes; with 2^128 of them, none has
+ * been added, so every positive is a false one. The bytes come from
+ * splitmix64 written little-endian, so a seed gives the same keys everywhere.
+ */
+#define FPR_KEY_BYTES 16
+#define FPR_DEFAULT_SAMPLES 100000
+
+struct fpr_job {
+  const struct bloom *bloom;
+  uint64_t seed;
+  size_t samples;
+  size_t positives;
+};
+
+static uint64_t
+splitmix64(uint64_t *state)
+{
+  uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+static void *
+measure_fpr_nogvl(void *ptr)
+{
+  struct fpr_job *job = ptr;
+  unsigned char keys[BLOOM_BATCH * FPR_KEY_BYTES];
+  size_t offsets[BLOOM_BATCH + 1], done, n, i, j;
+  char found[BLOOM_BATCH];
+  uint64_t state = job->seed, r;
+
+  for (i = 0; i <= BLOOM_BATCH; ++i) offsets[i] = i * FPR_KEY_BYTES;
+  job->positives = 0;
+  for (done = 0; done < job->samples; done += n) {
+    n = job->samples - done < BLOOM_BATCH ? job->samples - done : BLOOM_BATCH;
+    for (i = 0; i < n * FPR_KEY_BYTES; i += 8) {
+      r = splitmix64(&state);
+      for (j = 0; j < 8; ++j) keys[i + j] = (unsigned char)(r >> (8 * j));
+    }
+    bloom_query_keys(job->bloom, (const char *)keys, offsets, n, found);
+    for (i = 0; i < n; ++i) job->positives += found[i];
+  }
+
+  return 0;
+}
+
+/*
+ * call-seq:
+ *   filter.measure_fpr                          -> Float
+ *   filter.measure_fpr(samples: n, seed: seed)  -> Float
+ *
+ * Measure the false positive rate of the filter as it is: query
+ * <i>n</i> (by default 100,000) random keys that were never added, and
+ * return the fraction reported present. This goes through the same probe
+ * code as <code>query</code>, so it checks the filter itself rather than the
+ * model behind <code>expected_fpr</code> and <code>current_fpr</code>, which
+ * it should agree with to within sampling error (about
+ * <code>sqrt(fpr / n)</code>).
+ *
+ * The keys are generated from <i>seed</i>, an Integer, so that a
+ * measurement can be repeated; a random seed is used by default. The
+ * handler isn't called and <code>stats</code> aren't counted. At least
+ * <code>BloomFilter.nogvl_threshold</code> samples are probed without
+ * holding the GVL.
+ *
+ * <code>rake bench:fpr</code> compares the measurement with theory for every
+ * layout and hash engine.
+ */
+static VALUE
+filter_measure_fpr(int argc, VALUE *argv, VALUE obj)
+{
+  struct filter *filter;
+  struct fpr_job job;
+  VALUE opts, kwargs[2];
+  ID kwids[2];
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  rb_scan_args(argc, argv, ":", &opts);
+  kwargs[0] = kwargs[1] = Qundef;
+  if (!NIL_P(opts)) {
+    kwids[0] = id_samples;
+    kwids[1] = id_seed;
+    rb_get_kwargs(opts, kwids, 0, 2, kwargs);
+  }
+  FILTER_CHECK(filter);
+
+  job.bloom = &filter->bloom;
+  job.samples = kwargs[0] == Qundef ? FPR_DEFAULT_SAMPLES : NUM2SIZET(kwargs[0]);
+  if (job.samples == 0)
+    rb_raise(rb_eArgError, "samples must be positive");
+  if (kwargs[1] == Qundef || NIL_P(kwargs[1])) {
+    job.seed = (uint64_t)rb_genrand_int32() << 32 | rb_genrand_int32();
+  }
+  else {
+    job.seed = NUM2ULL(rb_funcall(kwargs[1], '&', 1, ULL2NUM(UINT64_MAX)));
+  }
+
+  if (job.samples >= (size_t)nogvl_threshold) {
+    rb_thread_call_without_gvl(measure_fpr_nogvl, &job, 0, 0);
+  }
+  else {
+    measure_fpr_nogvl(&job);
+  }
+  return DBL2NUM((double)job.positives / job.samples);
+}
+
+/* Set algebra. Two filters with the same size, hash count, layout and
+ * reduction map every key to the same bits, so the union of their sets is
+ * the OR of their bit arrays, and the AND is a filter for (a superset of)
+ * the intersection.
+ */
+
+/* Arguments of bloom_combine, for running it without the GVL */
+struct merge_job {
+  uint64_t *dst;
+  const uint64_t *src;
+  size_t nwords;
+  enum bloom_op op;
+  int nthreads;
+};
+
+static void *
+merge_nogvl(void *ptr)
+{
+  struct merge_job *job = ptr;
+
+  bloom_combine(job->dst, job->src, job->nwords, job->op, job->nthreads);
+  return 0;
+}
+
+/* Whether two bit arrays probe the same bits for a key */
+static void
+check_same_shape(const struct bloom *bloom, const struct bloom *other)
+{
+  if (bloom->arycapa != other->arycapa)
+    rb_raise(rb_eArgError, "bloom filters have different sizes");
+  if (bloom->nhashes != other->nhashes)
+    rb_raise(rb_eArgError, "bloom filters have different hash counts");
+  if (bloom->layout != other->layout)
+    rb_raise(rb_eArgError, "bloom filters have different layouts");
+  if (bloom->reduction != other->reduction)
+    rb_raise(rb_eArgError, "bloom filters have different reductions");
+  if (bloom->engine != other->engine)
+    rb_raise(rb_eArgError, "bloom filters have different hash engines");
+  if (memcmp(bloom->hashkey, other->hashkey, HASH_KEY_SIZE) != 0)
+    rb_raise(rb_eArgError, "bloom filters have different hash keys");
+}
+
+static void
+filter_check_compatible(struct filter *filter, struct filter *other)
+{
+  FILTER_CHECK(other);
+  check_same_shape(&filter->bloom, &other->bloom);
+}
+
+static VALUE
+filter_combine(int argc, VALUE *argv, VALUE obj, enum bloom_op op)
+{
+  struct filter *filter, *other;
+  struct merge_job job;
+  VALUE arg, opts, threads = Qundef;
+  ID kwid;
+
+  rb_scan_args(argc, argv, "1:", &arg, &opts);
+  if (!NIL_P(opts)) {
+    kwid = id_threads;
+    rb_get_kwargs(opts, &kwid, 0, 1, &threads);
+  }
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  TypedData_Get_Struct(arg, struct filter, &filter_type, other);
+  rb_check_frozen(obj);
+  FILTER_CHECK_WRITABLE(filter);
+  filter_check_compatible(filter, other);
+
+  job.dst = filter->bloom.bitary;
+  job.src = other->bloom.bitary;
+  job.nwords = filter->bloom.arycapa;
+  job.op = op;
+  job.nthreads = threads == Qundef || NIL_P(threads) ? 1 : NUM2INT(threads);
+  if (job.nthreads < 1 || job.nthreads > BLOOM_MAX_THREADS)
+    rb_raise(rb_eArgError, "threads must be between 1 and %d", BLOOM_MAX_THREADS);
+
+  if (filter->bloom.bitary == other->bloom.bitary) return obj;
+  if (filter->bloom.arycapa >= WORDS_NOGVL_THRESHOLD) {
+    rb_thread_call_without_gvl(merge_nogvl, &job, 0, 0);
+  }
+  else {
+    merge_nogvl(&job);
+  }
+  RB_GC_GUARD(arg);
+
+  if (filter->bloom.track_fill) {
+    filter->bloom.track_fill = 0;
+    filter->bloom.nset = filter_bits_set(filter);
+    filter->bloom.track_fill = 1;
+  }
+  if (op == BLOOM_OR && other->capa > filter->capa)
+    filter->capa = other->capa;
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.merge!(other)               -> filter
+ *   filter.merge!(other, threads: n)   -> filter
+ *
+ * Add every item of <i>other</i> to the filter, by ORing their bit arrays.
+ * The filters must have the same <code>bit_count</code>,
+ * <code>hash_count</code>, <code>layout</code>, <code>reduction</code> and
+ * hash engine and key, which is the case for filters created with the same
+ * arguments.
+ *
+ * The words are combined with SSE2 or AVX2 where the CPU has them. Bit
+ * arrays of 1 MB or more are combined without holding the GVL, split into
+ * <i>n</i> ranges processed by separate threads.
+ */
+static VALUE
+filter_merge(int argc, VALUE *argv, VALUE obj)
+{
+  return filter_combine(argc, argv, obj, BLOOM_OR);
+}
+
+/*
+ * call-seq:
+ *   filter.intersect!(other)               -> filter
+ *   filter.intersect!(other, threads: n)   -> filter
+ *
+ * Keep only the bits set in both filters. The result reports every item
+ * that was added to both, but is not as accurate as a filter built from only
+ * those items: an item added to just one of them may still match. See
+ * <code>merge!</code> for the requirements on <i>other</i>.
+ */
+static VALUE
+filter_intersect(int argc, VALUE *argv, VALUE obj)
+{
+  return filter_combine(argc, argv, obj, BLOOM_AND);
+}
+
+/*
+ * call-seq:
+ *   filter.initialize_copy(orig)   -> filter
+ *
+ * Copy the bit array, so that <code>dup</code> and <code>clone</code> give
+ * an independent filter. A copy of a mapped filter lives on the heap.
+ */
+static VALUE
+filter_initialize_copy(VALUE obj, VALUE orig)
+{
+  struct filter *filter, *src;
+
+  if (obj == orig) return obj;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  TypedData_Get_Struct(orig, struct filter, &filter_type, src);
+  if (filter->bloom.bitary)
+    rb_raise(rb_eTypeError, "bloom filter already initialized");
+
+  filter->capa = src->capa;
+  filter->bloom.nhashes = src->bloom.nhashes;
+  filter->bloom.layout = src->bloom.layout;
+  filter->bloom.reduction = src->bloom.reduction;
+  filter->bloom.track_fill = src->bloom.track_fill;
+  filter->bloom.nset = src->bloom.nset;
+  filter->bloom.concurrent = src->bloom.concurrent;
+  filter->bloom.engine = src->bloom.engine;
+  memcpy(filter->bloom.hashkey, src->bloom.hashkey, HASH_KEY_SIZE);
+  filter->track_stats = src->track_stats;
+  filter->stats = src->stats;
+  filter->batch_handler = src->batch_handler;
+  RB_OBJ_WRITE(obj, &filter->block, src->block);
+  filter_alloc_bits(filter, src->bloom.arycapa);
+  if (src->bloom.arycapa)
+    memcpy(filter->bloom.bitary, src->bloom.bitary, src->bloom.arycapa * sizeof(uint64_t));
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter | other    -> new_filter
+ *
+ * Get a new filter holding the items of both filters; see
+ * <code>merge!</code>.
+ */
+static VALUE
+filter_union(VALUE obj, VALUE other)
+{
+  return filter_merge(1, &other, rb_obj_dup(obj));
+}
+
+/*
+ * call-seq:
+ *   filter & other    -> new_filter
+ *
+ * Get a new filter for the items in both filters; see
+ * <code>intersect!</code>.
+ */
+static VALUE
+filter_and(VALUE obj, VALUE other)
+{
+  return filter_intersect(1, &other, rb_obj_dup(obj));
+}
+
+/* Serialized form. All fields are little-endian:
+ *
+ *    0  magic "BLOOMFLT"
+ *    8  u32 format version
+ *   12  u8  hash engine
+ *   13  u8  layout
+ *   14  u8  reduction
+ *   15  u8  reserved, 0
+ *   16  u32 hash count
+ *   20  u32 reserved, 0
+ *   24  u64 capacity
+ *   32  u64 number of 64-bit words in the bit array
+ *   40  u64 checksum: XXH64 of the bit array, seeded with XXH64 of bytes 0-39
+ *       (and then of bytes 48-63 for keyed hash engines)
+ *   48  hash key for keyed hash engines, otherwise reserved, 0
+ *   64  the bit array, as little-endian 64-bit words
+ *
+ * The header is a whole cache line, so the bit array keeps its alignment
+ * when the file is read or mapped into memory.
+ */
+#define DUMP_MAGIC "BLOOMFLT"
+#define DUMP_VERSION 1
+#define DUMP_HEADER_SIZE 64
+#define DUMP_CHECKSUM_OFFSET 40
+#define DUMP_HASH_KEY_OFFSET 48
+#define DUMP_IO_CHUNK (1 << 20)
+
+static void
+put_u32le(unsigned char *p, uint32_t v)
+{
+  int i;
+  for (i = 0; i < 4; ++i) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void
+put_u64le(unsigned char *p, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; ++i) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t
+get_u32le(const unsigned char *p)
+{
+  uint32_t v = 0;
+  int i;
+  for (i = 0; i < 4; ++i) v |= (uint32_t)p[i] << (8 * i);
+  return v;
+}
+
+static uint64_t
+get_u64le(const unsigned char *p)
+{
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < 8; ++i) v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+/* Convert between host and little-endian words in place; a no-op on
+ * little-endian hosts, where dump and load are a straight copy.
+ */
+static void
+swap_words_le(uint64_t *words, size_t n)
+{
+#ifdef WORDS_BIGENDIAN
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    words[i] = get_u64le((const unsigned char *)&words[i]);
+  }
+#else
+  (void)words;
+  (void)n;
+#endif
+}
+
+/* The checksum covers the header fields and, for keyed engines, the hash
+ * key; both are folded into the seed used for the bit array.
+ */
+static uint64_t
+dump_checksum_seed(const unsigned char *header)
+{
+  uint64_t seed = XXH64(header, DUMP_CHECKSUM_OFFSET, 0);
+
+  if (HASH_ENGINE_KEYED(header[12]))
+    seed = XXH64(header + DUMP_HASH_KEY_OFFSET, HASH_KEY_SIZE, seed);
+  return seed;
+}
+
+static uint64_t
+dump_checksum(const unsigned char *header, const void *words, size_t len)
+{
+  return (uint64_t)XXH64(words, len, dump_checksum_seed(header));
+}
+
+static void
+dump_header(const struct filter *filter, unsigned char *header)
+{
+  memset(header, 0, DUMP_HEADER_SIZE);
+  memcpy(header, DUMP_MAGIC, 8);
+  put_u32le(header + 8, DUMP_VERSION);
+  header[12] = (unsigned char)filter->bloom.engine;
+  header[13] = (unsigned char)filter->bloom.layout;
+  header[14] = (unsigned char)filter->bloom.reduction;
+  put_u32le(header + 16, filter->bloom.nhashes);
+  put_u64le(header + 24, filter->capa);
+  put_u64le(header + 32, filter->bloom.arycapa);
+  if (HASH_ENGINE_KEYED(filter->bloom.engine))
+    memcpy(header + DUMP_HASH_KEY_OFFSET, filter->bloom.hashkey, HASH_KEY_SIZE);
+}
+
+#define LOAD_ERROR(msg) rb_raise(rb_eArgError, "invalid bloom filter dump: %s", (msg))
+
+/* Check a header and set up filter to match it, except for the bit array,
+ * whose length in words is stored in nwords. Returns the checksum.
+ */
+static uint64_t
+load_header(struct filter *filter, const unsigned char *header, size_t *nwords_out)
+{
+  uint64_t capa, nwords;
+  uint32_t nhashes;
+
+  if (memcmp(header, DUMP_MAGIC, 8) != 0)
+    LOAD_ERROR("bad magic");
+  if (get_u32le(header + 8) != DUMP_VERSION)
+    rb_raise(rb_eArgError, "unsupported bloom filter dump version %u", get_u32le(header + 8));
+  if (header[12] >= HASH_ENGINE_COUNT)
+    LOAD_ERROR("unknown hash engine");
+  if (header[13] > BLOOM_LAYOUT_BLOCKED)
+    LOAD_ERROR("unknown layout");
+  if (header[14] > BLOOM_REDUCE_FASTRANGE)
+    LOAD_ERROR("unknown reduction");
+
+  nhashes = get_u32le(header + 16);
+  capa = get_u64le(header + 24);
+  nwords = get_u64le(header + 32);
+  if (nhashes < 1 || nhashes > BLOOM_MAX_HASH_COUNT)
+    LOAD_ERROR("bad hash count");
+  if (nwords >= SIZE_MAX / 2 / sizeof(uint64_t) || capa > SIZE_MAX)
+    LOAD_ERROR("bit array too large");
+  if (header[13] == BLOOM_LAYOUT_BLOCKED && nwords % BLOOM_WORDS_PER_BLOCK != 0)
+    LOAD_ERROR("bit array is not a whole number of blocks");
+  if (header[14] == BLOOM_REDUCE_MASK && (nwords & (nwords - 1)) != 0)
+    LOAD_ERROR("bit array size is not a power of two");
+
+  filter->bloom.engine = header[12];
+  if (HASH_ENGINE_KEYED(filter->bloom.engine))
+    memcpy(filter->bloom.hashkey, header + DUMP_HASH_KEY_OFFSET, HASH_KEY_SIZE);
+  filter->bloom.layout = (enum bloom_layout)header[13];
+  filter->bloom.reduction = (enum bloom_reduction)header[14];
+  filter->bloom.nhashes = nhashes;
+  filter->capa = (size_t)capa;
+  *nwords_out = (size_t)nwords;
+
+  return get_u64le(header + DUMP_CHECKSUM_OFFSET);
+}
+
+/*
+ * call-seq:
+ *   filter.dump       -> String
+ *   filter.dump(io)   -> io
+ *
+ * Serialize the filter to a binary string, or write it to <i>io</i>. The
+ * result can be read back with <code>BloomFilter.load</code> on any platform.
+ * It records the format version, hash engine, hash count, size, layout and a
+ * checksum along with the bit array. The handler Proc is not saved.
+ */
+static VALUE
+filter_dump(int argc, VALUE *argv, VALUE obj)
+{
+  struct filter *filter;
+  unsigned char *header;
+  size_t nbytes, off, len;
+  VALUE io, str, chunk;
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  rb_scan_args(argc, argv, "01", &io);
+  nbytes = filter->bloom.arycapa * sizeof(uint64_t);
+
+  if (NIL_P(io)) {
+    str = rb_str_new(0, DUMP_HEADER_SIZE + nbytes);
+    header = (unsigned char *)RSTRING_PTR(str);
+    dump_header(filter, header);
+    if (nbytes) {
+      memcpy(header + DUMP_HEADER_SIZE, filter->bloom.bitary, nbytes);
+      swap_words_le((uint64_t *)(header + DUMP_HEADER_SIZE), filter->bloom.arycapa);
+    }
+    put_u64le(header + DUMP_CHECKSUM_OFFSET,
+              dump_checksum(header, header + DUMP_HEADER_SIZE, nbytes));
+    return str;
+  }
+
+  /* Write the bit array a chunk at a time rather than building the whole
+   * dump in memory.
+   */
+  str = rb_str_new(0, DUMP_HEADER_SIZE);
+  header = (unsigned char *)RSTRING_PTR(str);
+  dump_header(filter, header);
+#ifdef WORDS_BIGENDIAN
+  {
+    XXH64_state_t *state = XXH64_createState();
+    XXH64_reset(state, dump_checksum_seed(header));
+    for (off = 0; off < nbytes; off += sizeof(uint64_t)) {
+      unsigned char word[8];
+      put_u64le(word, filter->bloom.bitary[off / sizeof(uint64_t)]);
+      XXH64_update(state, word, 8);
+    }
+    put_u64le(header + DUMP_CHECKSUM_OFFSET, XXH64_digest(state));
+    XXH64_freeState(state);
+  }
+#else
+  put_u64le(header + DUMP_CHECKSUM_OFFSET, dump_checksum(header, filter->bloom.bitary, nbytes));
+#endif
+  rb_funcall(io, id_write, 1, str);
+
+  for (off = 0; off < nbytes; off += len) {
+    len = nbytes - off < DUMP_IO_CHUNK ? nbytes - off : DUMP_IO_CHUNK;
+    chunk = rb_str_new((const char *)filter->bloom.bitary + off, len);
+    swap_words_le((uint64_t *)RSTRING_PTR(chunk), len / sizeof(uint64_t));
+    rb_funcall(io, id_write, 1, chunk);
+  }
+
+  return io;
+}
+
+static VALUE
+read_exactly(VALUE io, size_t len, VALUE buf)
+{
+  VALUE str = rb_funcall(io, id_read, 2, SIZET2NUM(len), buf);
+
+  if (NIL_P(str) || (size_t)RSTRING_LEN(str) != len)
+    LOAD_ERROR("unexpected end of input");
+
+  return str;
+}
+
+/*
+ * call-seq:
+ *   BloomFilter.load(string)   -> filter
+ *   BloomFilter.load(io)       -> filter
+ *
+ * Create a filter from the output of <code>filter.dump</code>. An IO (or any
+ * object responding to <code>read</code>) is read straight into the new
+ * filter's bit array. Raises ArgumentError if the data is truncated, was
+ * written by an incompatible version, or fails its checksum.
+ */
+static VALUE
+filter_s_load(VALUE klass, VALUE src)
+{
+  struct filter *filter;
+  uint64_t checksum;
+  const unsigned char *ptr;
+  unsigned char header[DUMP_HEADER_SIZE];
+  size_t nwords, nbytes, off, len;
+  VALUE obj = rb_obj_alloc(klass), buf;
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  if (!RB_TYPE_P(src, T_STRING) && rb_respond_to(src, id_read)) {
+    buf = read_exactly(src, DUMP_HEADER_SIZE, Qnil);
+    memcpy(header, RSTRING_PTR(buf), DUMP_HEADER_SIZE);
+    checksum = load_header(filter, header, &nwords);
+    filter_alloc_bits(filter, nwords);
+    nbytes = filter->bloom.arycapa * sizeof(uint64_t);
+
+    for (off = 0; off < nbytes; off += len) {
+      len = nbytes - off < DUMP_IO_CHUNK ? nbytes - off : DUMP_IO_CHUNK;
+      read_exactly(src, len, buf);
+      memcpy((char *)filter->bloom.bitary + off, RSTRING_PTR(buf), len);
+    }
+  }
+  else {
+    StringValue(src);
+    if (RSTRING_LEN(src) < DUMP_HEADER_SIZE)
+      LOAD_ERROR("unexpected end of input");
+
+    ptr = (const unsigned char *)RSTRING_PTR(src);
+    memcpy(header, ptr, DUMP_HEADER_SIZE);
+    checksum = load_header(filter, header, &nwords);
+    if ((size_t)RSTRING_LEN(src) != DUMP_HEADER_SIZE + nwords * sizeof(uint64_t))
+      LOAD_ERROR("length does not match header");
+    filter_alloc_bits(filter, nwords);
+    nbytes = filter->bloom.arycapa * sizeof(uint64_t);
+    if (nbytes) memcpy(filter->bloom.bitary, ptr + DUMP_HEADER_SIZE, nbytes);
+  }
+
+  if (dump_checksum(header, filter->bloom.bitary, nbytes) != checksum)
+    LOAD_ERROR("checksum mismatch");
+  swap_words_le(filter->bloom.bitary, filter->bloom.arycapa);
+
+  return obj;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static int
+get_advice(VALUE sym)
+{
+  ID id;
+
+  if (!SYMBOL_P(sym))
+    rb_raise(rb_eTypeError, "advice must be a Symbol");
+
+  id = SYM2ID(sym);
+  if (id == id_normal) return MADV_NORMAL;
+  if (id == id_random) return MADV_RANDOM;
+  if (id == id_sequential) return MADV_SEQUENTIAL;
+  if (id == id_willneed) return MADV_WILLNEED;
+
+  rb_raise(rb_eArgError, "unknown advice: %"PRIsVALUE, sym);
+  UNREACHABLE;
+}
+
+/*
+ * call-seq:
+ *   BloomFilter.open(path)                                  -> filter
+ *   BloomFilter.open(path, mode: :readwrite)                -> filter
+ *   BloomFilter.open(path, advice: :willneed, populate: true) -> filter
+ *
+ * Map a file written by <code>filter.dump</code> into memory and use it as the
+ * filter's bit array without copying it. Processes that open the same file
+ * share its pages through the page cache, and pages are only read from disk
+ * as queries touch them.
+ *
+ * <code>mode</code> is <code>:readonly</code> (the default), in which case
+ * adding to the filter raises IOError, or <code>:readwrite</code>, in which
+ * case additions are written through to the file; call <code>flush</code> to
+ * update its checksum and sync it to disk.
+ *
+ * <code>advice</code> is passed to madvise(2): <code>:random</code> (the
+ * default, since queries touch pages at random), <code>:willneed</code>,
+ * <code>:sequential</code> or <code>:normal</code>. With
+ * <code>populate: true</code> the whole file is faulted in up front where the
+ * platform supports it. The checksum is only verified with
+ * <code>verify: true</code>, since that reads the whole file.
+ */
+static VALUE
+filter_s_open(int argc, VALUE *argv, VALUE klass)
+{
+  struct filter *filter;
+  struct stat st;
+  size_t nwords;
+  uint64_t checksum;
+  unsigned char *map;
+  int fd, flags = MAP_SHARED, advice = MADV_RANDOM, readonly = 1, verify = 0, e;
+  VALUE path, opts, kwargs[4], obj;
+  ID kwids[4];
+
+  rb_scan_args(argc, argv, "1:", &path, &opts);
+  FilePathValue(path);
+
+  kwargs[0] = kwargs[1] = kwargs[2] = kwargs[3] = Qundef;
+  if (!NIL_P(opts)) {
+    kwids[0] = id_mode;
+    kwids[1] = id_advice;
+    kwids[2] = id_populate;
+    kwids[3] = id_verify;
+    rb_get_kwargs(opts, kwids, 0, 4, kwargs);
+  }
+  if (kwargs[0] != Qundef) {
+    if (kwargs[0] == ID2SYM(id_readwrite)) readonly = 0;
+    else if (kwargs[0] != ID2SYM(id_readonly))
+      rb_raise(rb_eArgError, "unknown mode: %"PRIsVALUE, kwargs[0]);
+  }
+  if (kwargs[1] != Qundef) advice = get_advice(kwargs[1]);
+#ifdef MAP_POPULATE
+  if (kwargs[2] != Qundef && RTEST(kwargs[2])) flags |= MAP_POPULATE;
+#endif
+  if (kwargs[3] != Qundef) verify = RTEST(kwargs[3]);
+
+#ifdef WORDS_BIGENDIAN
+  rb_raise(rb_eNotImpError, "mapped bloom filters need a little-endian host");
+#endif
+
+  obj = rb_obj_alloc(klass);
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  fd = rb_cloexec_open(RSTRING_PTR(path), readonly ? O_RDONLY : O_RDWR, 0);
+  if (fd < 0) rb_sys_fail_str(path);
+  if (fstat(fd, &st) < 0) {
+    e = errno;
+    close(fd);
+    rb_syserr_fail_str(e, path);
+  }
+  if ((uint64_t)st.st_size < DUMP_HEADER_SIZE || (uint64_t)st.st_size > SIZE_MAX) {
+    close(fd);
+    LOAD_ERROR("unexpected end of input");
+  }
+
+  map = mmap(0, (size_t)st.st_size, readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+             flags, fd, 0);
+  e = errno;
+  close(fd);
+  if (map == MAP_FAILED) rb_syserr_fail_str(e, path);
+
+  /* from here on, filter_free unmaps the file if loading fails */
+  filter->map = map;
+  filter->maplen = (size_t)st.st_size;
+  filter->readonly = readonly;
+
+  checksum = load_header(filter, map, &nwords);
+  if ((size_t)st.st_size != DUMP_HEADER_SIZE + nwords * sizeof(uint64_t))
+    LOAD_ERROR("length does not match header");
+  filter->bloom.arycapa = nwords;
+  filter->bloom.bitary = nwords ? (uint64_t *)(map + DUMP_HEADER_SIZE) : 0;
+
+  if (verify && dump_checksum(map, filter->bloom.bitary, nwords * sizeof(uint64_t)) != checksum)
+    LOAD_ERROR("checksum mismatch");
+  madvise(map, filter->maplen, advice);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.flush   -> filter
+ *
+ * For a filter opened with <code>mode: :readwrite</code>, update the
+ * checksum in the file's header and write the mapping back to disk with
+ * msync(2). Does nothing for other filters. Like the other writes, it raises
+ * FrozenError on a frozen filter.
+ */
+static VALUE
+filter_flush(VALUE obj)
+{
+  struct filter *filter;
+  unsigned char *map;
+
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  if (!filter->map || filter->readonly) return obj;
+  rb_check_frozen(obj);
+
+  map = filter->map;
+  put_u64le(map + DUMP_CHECKSUM_OFFSET,
+            dump_checksum(map, filter->bloom.bitary, filter->bloom.arycapa * sizeof(uint64_t)));
+  if (msync(filter->map, filter->maplen, MS_SYNC) < 0)
+    rb_sys_fail("msync");
+
+  return obj;
+}
+#endif  /* HAVE_SYS_MMAN_H */
+
+/*
+ * call-seq:
+ *   filter.mapped_size   -> Number
+ *
+ * Get the number of bytes of the filter that are mapped from a file by
+ * <code>BloomFilter.open</code> rather than owned by the process; 0 for
+ * filters built in memory. <code>ObjectSpace.memsize_of</code> only counts
+ * owned memory.
+ */
+static VALUE
+filter_mapped_size(VALUE obj)
+{
+  struct filter *filter;
+  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+
+  return SIZET2NUM(filter->maplen);
+}
+
+/*
+ * call-seq:
+ *   filter._dump(level)   -> String
+ *
+ * Marshal support; see <code>filter.dump</code>.
+ */
+static VALUE
+filter_marshal_dump(VALUE obj, VALUE level)
+{
+  return filter_dump(0, 0, obj);
+}
+
+/*
+ * call-seq:
+ *   BloomFilter._load(string)   -> filter
+ *
+ * Marshal support; see <code>BloomFilter.load</code>.
+ */
+static VALUE
+filter_marshal_load(VALUE klass, VALUE str)
+{
+  return filter_s_load(klass, str);
+}
+
+/* Scalable filters: a chain of slices, each larger and with a lower false
+ * positive rate than the last, so that the compound rate converges however
+ * many items are added (Almeida, Baquero, Preguica, Hutchison: "Scalable
+ * Bloom Filters").
+ */
+#define SCALABLE_GROWTH 2.0
+#define SCALABLE_TIGHTENING 0.85
+#define SCALABLE_FPR 0.01
+
+struct scalable_slice {
+  struct filter *filter;
+  size_t nset;
+  size_t limit;
+};
+
+struct scalable {
+  size_t capa;
+  double fpr;
+  double growth;
+  double tightening;
+  double fill;
+  enum bloom_layout layout;
+  VALUE block;
+  VALUE slices;
+  struct scalable_slice *slice;
+  long nslices;
+};
+
+static void
+scalable_mark(void *ptr)
+{
+  struct scalable *scalable = ptr;
+  rb_gc_mark(scalable->block);
+  rb_gc_mark(scalable->slices);
+}
+
+static void
+scalable_free(void *ptr)
+{
+  struct scalable *scalable = ptr;
+
+  if (scalable->slice) xfree(scalable->slice);
+  xfree(scalable);
+}
+
+static size_t
+scalable_memsize(const void *ptr)
+{
+  const struct scalable *scalable = ptr;
+  return sizeof(struct scalable) + scalable->nslices * sizeof(struct scalable_slice);
+}
+
+static const rb_data_type_t scalable_type = {
+  "bloom_filter/scalable",
+  {
+    scalable_mark,
+    scalable_free,
+    scalable_memsize
+  },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | FILTER_TYPED_SHAREABLE
+};
+
+static VALUE
+scalable_allocate(VALUE klass)
+{
+  struct scalable *scalable;
+  VALUE obj = TypedData_Make_Struct(klass, struct scalable, &scalable_type, scalable);
+
+  scalable->capa    = 0;
+  scalable->fpr     = SCALABLE_FPR;
+  scalable->growth  = SCALABLE_GROWTH;
+  scalable->tightening = SCALABLE_TIGHTENING;
+  scalable->fill    = 0;
+  scalable->layout  = BLOOM_LAYOUT_STANDARD;
+  scalable->block   = Qnil;
+  scalable->slices  = Qnil;
+  scalable->slice   = 0;
+  scalable->nslices = 0;
+  RB_OBJ_WRITE(obj, &scalable->slices, rb_ary_new());
+
+  return obj;
+}
+
+#define SCALABLE_CHECK(s) do {                                          \
+  if ((s)->nslices == 0) {                                              \
+    rb_raise(rb_eRuntimeError, "Uninitialized scalable bloom filter");  \
+  }                                                                     \
+} while (0)
+
+/* Append slice i: its capacity is capa * growth**i and its false positive
+ * rate fpr * (1 - tightening) * tightening**i, so the rates of all slices sum
+ * to at most fpr.
+ */
+static void
+scalable_add_slice(VALUE obj, struct scalable *scalable)
+{
+  long i = scalable->nslices;
+  double capa = scalable->capa * pow(scalable->growth, (double)i);
+  double fpr = scalable->fpr * (1 - scalable->tightening) * pow(scalable->tightening, (double)i);
+  struct filter *filter;
+  double fill;
+  VALUE slice;
+
+  if (capa >= (double)SIZE_MAX / BLOOM_BITS_PER_WORD || !(fpr > 0))
+    rb_raise(rb_eRangeError, "scalable bloom filter cannot grow any further");
+
+  slice = filter_allocate(cBloomFilter);
+  TypedData_Get_Struct(slice, struct filter, &filter_type, filter);
+  filter->bloom.layout = scalable->layout;
+  filter->capa = (size_t)capa;
+  filter_alloc_bits(filter, filter_sizing(filter, filter->capa, DBL2NUM(fpr),
+                                          Qundef, Qundef, Qundef, Qundef));
+
+  REALLOC_N(scalable->slice, struct scalable_slice, i + 1);
+  scalable->slice[i].filter = filter;
+  scalable->slice[i].nset = 0;
+
+  /* Unless told otherwise, the slice is full when as many bits are set as
+   * there would be with capa items in it.
+   */
+  fill = scalable->fill;
+  if (fill == 0)
+    fill = 1 - exp(-(double)filter->bloom.nhashes * filter->capa / TOTAL_BITS(filter));
+  scalable->slice[i].limit = (size_t)(fill * TOTAL_BITS(filter));
+  rb_ary_push(scalable->slices, slice);
+  scalable->nslices = i + 1;
+}
+
+/* Newest slice first: it is the largest, and holds the most recent items */
+static int
+scalable_get_digest(struct scalable *scalable, const struct string_digest *digest)
+{
+  long i;
+
+  for (i = scalable->nslices - 1; i >= 0; --i) {
+    if (bloom_get_digest(&scalable->slice[i].filter->bloom, digest))
+      return 1;
+  }
+  return 0;
+}
+
+/* Items that are already present are not added again, so repeated keys don't
+ * use up the capacity of the newest slice.
+ */
+static void
+scalable_add_digest(VALUE obj, struct scalable *scalable, const struct string_digest *digest)
+{
+  struct scalable_slice *slice;
+
+  if (scalable_get_digest(scalable, digest))
+    return;
+
+  slice = &scalable->slice[scalable->nslices - 1];
+  slice->nset += bloom_set_digest(&slice->filter->bloom, digest);
+  if (slice->nset >= slice->limit) {
+    scalable_add_slice(obj, scalable);
+  }
+}
+
+static VALUE
+scalable_add_item(VALUE obj, struct scalable *scalable, VALUE str)
+{
+  struct string_digest digest;
+
+  SCALABLE_CHECK(scalable);
+  get_digest(str, HASH_ENGINE_MURMUR3, 0, &digest);
+  scalable_add_digest(obj, scalable, &digest);
+
+  return str;
+}
+
+static double
+scalable_get_double(VALUE val, const char *name, double min, double max)
+{
+  double d = NUM2DBL(val);
+
+  if (!(d >= min && d <= max))
+    rb_raise(rb_eArgError, "%s must be between %g and %g", name, min, max);
+  return d;
+}
+
+/*
+ * call-seq:
+ *   BloomFilter::Scalable.new(capa)                        -> filter
+ *   BloomFilter::Scalable.new(capa) { |string| block }     -> filter
+ *   BloomFilter::Scalable.new(capa, fpr: 0.001)            -> filter
+ *   BloomFilter::Scalable.new(capa, growth: 4)             -> filter
+ *   BloomFilter::Scalable.new(capa, tightening: 0.5)       -> filter
+ *   BloomFilter::Scalable.new(capa, fill: 0.5)             -> filter
+ *   BloomFilter::Scalable.new(capa, layout: :blocked)      -> filter
+ *
+ * Construct a new scalable bloom filter. The first slice holds <i>capa</i>
+ * items; each further slice is <code>growth</code> times larger (2 by
+ * default) and has a false positive rate <code>tightening</code> times lower
+ * (0.85 by default).
+ *
+ * A new slice is started when the fraction of set bits in the newest one
+ * reaches <code>fill</code>. By default this is the fraction expected once
+ * the slice holds its capacity, about one half. The number of set bits is
+ * tracked as items are added, so duplicate items don't count twice. The false
+ * positive rate of the whole filter stays below <code>fpr</code> (0.01 by
+ * default) however many items are added.
+ *
+ * The block, if given, is the handler Proc, as for <code>BloomFilter.new</code>.
+ */
+static VALUE
+scalable_initialize(int argc, VALUE *argv, VALUE obj)
+{
+  struct scalable *scalable;
+  VALUE capa, opts, kwargs[5];
+  ID kwids[5];
+
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  if (scalable->nslices)
+    rb_raise(rb_eRuntimeError, "scalable bloom filter already initialized");
+
+  rb_scan_args(argc, argv, "1:", &capa, &opts);
+  scalable->capa = NUM2SIZET(capa);
+  if (scalable->capa == 0)
+    rb_raise(rb_eArgError, "capacity must be positive");
+
+  if (!NIL_P(opts)) {
+    kwids[0] = id_layout;
+    kwids[1] = id_fpr;
+    kwids[2] = id_growth;
+    kwids[3] = id_tightening;
+    kwids[4] = id_fill;
+    rb_get_kwargs(opts, kwids, 0, 5, kwargs);
+    if (kwargs[0] != Qundef) scalable->layout = get_layout(kwargs[0]);
+    if (kwargs[1] != Qundef) {
+      scalable->fpr = NUM2DBL(kwargs[1]);
+      if (!(scalable->fpr > 0 && scalable->fpr < 1))
+        rb_raise(rb_eArgError, "fpr must be between 0 and 1");
+    }
+    if (kwargs[2] != Qundef)
+      scalable->growth = scalable_get_double(kwargs[2], "growth", 1, 16);
+    if (kwargs[3] != Qundef)
+      scalable->tightening = scalable_get_double(kwargs[3], "tightening", 0.01, 0.99);
+    if (kwargs[4] != Qundef)
+      scalable->fill = scalable_get_double(kwargs[4], "fill", 0.01, 0.99);
+  }
+
+  scalable_add_slice(obj, scalable);
+
+  if (rb_block_given_p()) {
+    RB_OBJ_WRITE(obj, &scalable->block, rb_block_proc());
+  }
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.add(item)   -> filter
+ *   filter << item     -> filter
+ *
+ * Add an item to the newest slice, starting a new slice if it is full.
+ */
+static VALUE
+scalable_add(VALUE obj, VALUE item)
+{
+  struct scalable *scalable;
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  rb_check_frozen(obj);
+
+  scalable_add_item(obj, scalable, item);
+  return obj;
+}
+
+static VALUE
+scalable_add_all_i(RB_BLOCK_CALL_FUNC_ARGLIST(item, obj))
+{
+  struct scalable *scalable;
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+
+  scalable_add_item(obj, scalable, item);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   filter.add_all(array)    -> filter
+ *   filter.add_all(enum)     -> filter
+ *
+ * Add every item of an array, or every item yielded by <code>each</code>, to
+ * the filter.
+ */
+static VALUE
+scalable_add_all(VALUE obj, VALUE items)
+{
+  struct scalable *scalable;
+  long i;
+
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  rb_check_frozen(obj);
+  if (RB_TYPE_P(items, T_ARRAY)) {
+    for (i = 0; i < RARRAY_LEN(items); ++i) {
+      scalable_add_item(obj, scalable, RARRAY_AREF(items, i));
+    }
+  }
+  else {
+    rb_block_call(items, id_each, 0, 0, scalable_add_all_i, obj);
+  }
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.include?(item)    -> Bool
+ *   filter.query(item)       -> Bool
+ *
+ * Test an item to see if it's in any slice. The item is hashed once, and
+ * the slices are checked from the newest to the oldest. The handler Proc is
+ * called on a positive match, as for <code>BloomFilter#query</code>.
+ */
+static VALUE
+scalable_query(VALUE obj, VALUE str)
+{
+  struct scalable *scalable;
+  struct string_digest digest;
+
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  SCALABLE_CHECK(scalable);
+  get_digest(str, HASH_ENGINE_MURMUR3, 0, &digest);
+  if (!scalable_get_digest(scalable, &digest)) {
+    return Qfalse;
+  }
+
+  if (!NIL_P(scalable->block))
+    call_handler(scalable->block, str);
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   filter.handler       -> Proc or nil
+ *
+ * Get the handler Proc.
+ */
+static VALUE
+scalable_handler(VALUE obj)
+{
+  struct scalable *scalable;
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+
+  return scalable->block;
+}
+
+/*
+ * call-seq:
+ *   filter.handler = proc or nil   -> proc or nil
+ *
+ * Set the handler Proc.
+ */
+static VALUE
+scalable_set_handler(VALUE obj, VALUE handler)
+{
+  struct scalable *scalable;
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  rb_check_frozen(obj);
+
+  RB_OBJ_WRITE(obj, &scalable->block, handler);
+  return handler;
+}
+
+/*
+ * call-seq:
+ *   filter.slices      -> Array
+ *
+ * Get the slices, oldest first, as BloomFilter objects. Items should only be
+ * added through the scalable filter.
+ */
+static VALUE
+scalable_slices(VALUE obj)
+{
+  struct scalable *scalable;
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+
+  return rb_ary_dup(scalable->slices);
+}
+
+/*
+ * call-seq:
+ *   filter.slice_count   -> Number
+ *
+ * Get the number of slices.
+ */
+static VALUE
+scalable_slice_count(VALUE obj)
+{
+  struct scalable *scalable;
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+
+  return LONG2NUM(scalable->nslices);
+}
+
+/*
+ * call-seq:
+ *   filter.size      -> Number
+ *   filter.length    -> Number
+ *
+ * Get the total length of the slices' bit arrays in bytes.
+ */
+static VALUE
+scalable_size(VALUE obj)
+{
+  struct scalable *scalable;
+  size_t size = 0;
+  long i;
+
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  for (i = 0; i < scalable->nslices; ++i) {
+    size += scalable->slice[i].filter->bloom.arycapa * sizeof(uint64_t);
+  }
+  return SIZET2NUM(size);
+}
+
+/*
+ * call-seq:
+ *   filter.capacity     -> Number
+ *
+ * Get the total capacity of the slices created so far.
+ */
+static VALUE
+scalable_capacity(VALUE obj)
+{
+  struct scalable *scalable;
+  size_t capa = 0;
+  long i;
+
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  for (i = 0; i < scalable->nslices; ++i) {
+    capa += scalable->slice[i].filter->capa;
+  }
+  return SIZET2NUM(capa);
+}
+
+/*
+ * call-seq:
+ *   filter.expected_fpr   -> Float
+ *
+ * Estimate the current false positive rate of the filter from the fill of
+ * each slice: a slice with a fraction <i>f</i> of its bits set and <i>k</i>
+ * hash functions reports about <i>f</i>**<i>k</i> false positives. For the
+ * blocked layout this is a slight underestimate.
+ */
+static VALUE
+scalable_expected_fpr(VALUE obj)
+{
+  struct scalable *scalable;
+  double pass = 1, fill;
+  long i;
+
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+  for (i = 0; i < scalable->nslices; ++i) {
+    fill = (double)scalable->slice[i].nset / TOTAL_BITS(scalable->slice[i].filter);
+    pass *= 1 - pow(fill, scalable->slice[i].filter->bloom.nhashes);
+  }
+  return DBL2NUM(1 - pass);
+}
+
+/*
+ * call-seq:
+ *   filter.fpr   -> Float
+ *
+ * Get the bound on the false positive rate the filter was created with.
+ */
+static VALUE
+scalable_fpr(VALUE obj)
+{
+  struct scalable *scalable;
+  TypedData_Get_Struct(obj, struct scalable, &scalable_type, scalable);
+
+  return DBL2NUM(scalable->fpr);
+}
+
+/* Counting filters: each bit of a standard filter is replaced by a small
+ * saturating counter, so that items can be deleted. Counters are packed two
+ * to a byte (4-bit) or one to a byte (8-bit). A counter that reaches its
+ * maximum sticks there, since decrementing it could lose another item.
+ */
+#define COUNTER_BITS 4
+
+struct counting {
+  size_t capa;
+  size_t ncounters;
+  unsigned int nhashes;
+  unsigned int width;
+  enum bloom_reduction reduction;
+  VALUE block;
+  uint8_t *counters;
+  size_t saturated;
+  size_t overflows;
+};
+
+#define COUNTER_MAX(c) ((1U << (c)->width) - 1)
+#define COUNTING_BYTES(c) ((c)->ncounters * (c)->width / 8)
+
+#define COUNTING_CHECK(c) do {                                          \
+  if ((c)->counters == 0) {                                             \
+    rb_raise(rb_eRuntimeError, "Uninitialized counting bloom filter");  \
+  }                                                                     \
+} while (0)
+
+static inline unsigned int
+counter_get(const struct counting *counting, uint64_t i)
+{
+  if (counting->width == 8)
+    return counting->counters[i];
+  return (counting->counters[i >> 1] >> ((i & 1) << 2)) & 0xf;
+}
+
+static inline void
+counter_put(struct counting *counting, uint64_t i, unsigned int val)
+{
+  uint8_t *byte;
+
+  if (counting->width == 8) {
+    counting->counters[i] = (uint8_t)val;
+    return;
+  }
+  byte = &counting->counters[i >> 1];
+  *byte = (uint8_t)((*byte & ~(0xf << ((i & 1) << 2))) | (val << ((i & 1) << 2)));
+}
+
+/* Work out all k counter positions for a digest up front, and prefetch them,
+ * so that the loads for one key are in flight together and the loops over
+ * them are free of dependencies.
+ */
+static void
+counting_indexes(const struct counting *counting, const struct string_digest *digest,
+                 uint64_t *idx, int rw)
+{
+  uint64_t hash;
+  unsigned int i = 0;
+
+  HASH_ITERATE(digest, counting->nhashes, hash, {
+    idx[i++] = BLOOM_REDUCE(counting->reduction, hash, (uint64_t)counting->ncounters);
+  });
+  for (i = 0; i < counting->nhashes; ++i) {
+    BLOOM_PREFETCH_RW(&counting->counters[idx[i] * counting->width / 8], rw);
+  }
+}
+
+/* Smallest of the k counters: an upper bound on the number of times the
+ * item was added
+ */
+static unsigned int
+counting_min(const struct counting *counting, const struct string_digest *digest)
+{
+  uint64_t idx[BLOOM_MAX_HASH_COUNT];
+  unsigned int val[BLOOM_MAX_HASH_COUNT], min, i;
+
+  counting_indexes(counting, digest, idx, BLOOM_PREFETCH_READ);
+  for (i = 0; i < counting->nhashes; ++i) {
+    val[i] = counter_get(counting, idx[i]);
+  }
+  min = COUNTER_MAX(counting);
+  for (i = 0; i < counting->nhashes; ++i) {
+    min = val[i] < min ? val[i] : min;
+  }
+  return min;
+}
+
+static void
+counting_increment(struct counting *counting, const struct string_digest *digest)
+{
+  uint64_t idx[BLOOM_MAX_HASH_COUNT];
+  unsigned int val, max = COUNTER_MAX(counting), i;
+
+  counting_indexes(counting, digest, idx, BLOOM_PREFETCH_WRITE);
+  for (i = 0; i < counting->nhashes; ++i) {
+    val = counter_get(counting, idx[i]);
+    if (val == max) {
+      counting->overflows++;
+      continue;
+    }
+    counter_put(counting, idx[i], val + 1);
+    if (val + 1 == max) counting->saturated++;
+  }
+}
+
+static void
+counting_decrement(struct counting *counting, const struct string_digest *digest)
+{
+  uint64_t idx[BLOOM_MAX_HASH_COUNT];
+  unsigned int val, max = COUNTER_MAX(counting), i;
+
+  counting_indexes(counting, digest, idx, BLOOM_PREFETCH_WRITE);
+  for (i = 0; i < counting->nhashes; ++i) {
+    val = counter_get(counting, idx[i]);
+    if (val == max || val == 0) continue;
+    counter_put(counting, idx[i], val - 1);
+  }
+}
+
+static void
+counting_mark(void *ptr)
+{
+  struct counting *counting = ptr;
+  rb_gc_mark(counting->block);
+}
+
+static void
+counting_free(void *ptr)
+{
+  struct counting *counting = ptr;
+
+  if (counting->counters) xfree(counting->counters);
+  xfree(counting);
+}
+
+static size_t
+counting_memsize(const void *ptr)
+{
+  const struct counting *counting = ptr;
+  return sizeof(struct counting) + COUNTING_BYTES(counting);
+}
+
+static const rb_data_type_t counting_type = {
+  "bloom_filter/counting",
+  {
+    counting_mark,
+    counting_free,
+    counting_memsize
+  },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | FILTER_TYPED_SHAREABLE
+};
+
+static VALUE
+counting_allocate(VALUE klass)
+{
+  struct counting *counting;
+  VALUE obj = TypedData_Make_Struct(klass, struct counting, &counting_type, counting);
+
+  counting->capa      = 0;
+  counting->ncounters = 0;
+  counting->nhashes   = HASH_COUNT;
+  counting->width     = COUNTER_BITS;
+  counting->reduction = BLOOM_REDUCE_FASTRANGE;
+  counting->block     = Qnil;
+  counting->counters  = 0;
+  counting->saturated = 0;
+  counting->overflows = 0;
+
+  return obj;
+}
+
+static void
+counting_get_digest(struct counting *counting, VALUE str, struct string_digest *digest)
+{
+  COUNTING_CHECK(counting);
+  get_digest(str, HASH_ENGINE_MURMUR3, 0, digest);
+}
+
+/*
+ * call-seq:
+ *   BloomFilter::Counting.new(capa)                         -> filter
+ *   BloomFilter::Counting.new(capa) { |string| block }      -> filter
+ *   BloomFilter::Counting.new(capa, fpr: 0.001)             -> filter
+ *   BloomFilter::Counting.new(capa, bits_per_item: 12)      -> filter
+ *   BloomFilter::Counting.new(capa, hashes: k, ...)         -> filter
+ *   BloomFilter::Counting.new(capa, counter_bits: 8)        -> filter
+ *
+ * Construct a new counting bloom filter. The number of counters and hash
+ * functions is worked out as the number of bits and hash functions of a
+ * <code>BloomFilter</code> with the same options, so the false positive rate
+ * is the same. Each counter takes <code>counter_bits</code> bits, 4 by
+ * default or 8.
+ *
+ * A 4-bit counter saturates after 15 increments, which with the optimal
+ * number of hash functions is very unlikely before the filter is far over its
+ * capacity. Saturated counters are never decremented again; see
+ * <code>saturated</code> and <code>overflows</code>.
+ */
+static VALUE
+counting_initialize(int argc, VALUE *argv, VALUE obj)
+{
+  struct counting *counting;
+  struct filter sizing;
+  VALUE capa, opts, kwargs[4];
+  ID kwids[4];
+
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+  if (counting->counters)
+    rb_raise(rb_eRuntimeError, "counting bloom filter already initialized");
+
+  rb_scan_args(argc, argv, "1:", &capa, &opts);
+  counting->capa = NUM2SIZET(capa);
+
+  kwargs[0] = kwargs[1] = kwargs[2] = kwargs[3] = Qundef;
+  if (!NIL_P(opts)) {
+    kwids[0] = id_fpr;
+    kwids[1] = id_bits_per_item;
+    kwids[2] = id_hashes;
+    kwids[3] = id_counter_bits;
+    rb_get_kwargs(opts, kwids, 0, 4, kwargs);
+    if (kwargs[3] != Qundef) {
+      counting->width = NUM2UINT(kwargs[3]);
+      if (counting->width != 4 && counting->width != 8)
+        rb_raise(rb_eArgError, "counter_bits must be 4 or 8");
+    }
+  }
+
+  bloom_init(&sizing.bloom);
+  counting->ncounters = filter_sizing(&sizing, counting->capa, kwargs[0], kwargs[1],
+                                      kwargs[2], Qundef, Qundef) * BLOOM_BITS_PER_WORD;
+  counting->nhashes = sizing.bloom.nhashes;
+  counting->reduction = sizing.bloom.reduction;
+  counting->counters = xcalloc(COUNTING_BYTES(counting), 1);
+
+  if (rb_block_given_p()) {
+    RB_OBJ_WRITE(obj, &counting->block, rb_block_proc());
+  }
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.add(item)   -> filter
+ *   filter << item     -> filter
+ *
+ * Add an item to the filter. An item may be added more than once, and must
+ * then be deleted as many times.
+ */
+static VALUE
+counting_add(VALUE obj, VALUE str)
+{
+  struct counting *counting;
+  struct string_digest digest;
+
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+  rb_check_frozen(obj);
+  counting_get_digest(counting, str, &digest);
+  counting_increment(counting, &digest);
+  return obj;
+}
+
+static VALUE
+counting_add_all_i(RB_BLOCK_CALL_FUNC_ARGLIST(item, obj))
+{
+  return counting_add(obj, item);
+}
+
+/*
+ * call-seq:
+ *   filter.add_all(array)    -> filter
+ *   filter.add_all(enum)     -> filter
+ *
+ * Add every item of an array, or every item yielded by <code>each</code>, to
+ * the filter.
+ */
+static VALUE
+counting_add_all(VALUE obj, VALUE items)
+{
+  long i;
+
+  if (RB_TYPE_P(items, T_ARRAY)) {
+    for (i = 0; i < RARRAY_LEN(items); ++i) {
+      counting_add(obj, RARRAY_AREF(items, i));
+    }
+  }
+  else {
+    rb_block_call(items, id_each, 0, 0, counting_add_all_i, obj);
+  }
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   filter.delete(item)    -> Bool
+ *
+ * Remove one occurrence of an item from the filter. Returns false, leaving
+ * the filter unchanged, if the item is definitely not in the filter.
+ *
+ * Deleting an item that was never added, but is reported as present because
+ * of a false positive, can cause false negatives for other items.
+ */
+static VALUE
+counting_delete(VALUE obj, VALUE str)
+{
+  struct counting *counting;
+  struct string_digest digest;
+
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+  rb_check_frozen(obj);
+  counting_get_digest(counting, str, &digest);
+  if (counting_min(counting, &digest) == 0)
+    return Qfalse;
+
+  counting_decrement(counting, &digest);
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   filter.include?(item)    -> Bool
+ *   filter.query(item)       -> Bool
+ *
+ * Test an item to see if it's in the filter. The handler Proc is called on a
+ * positive match, as for <code>BloomFilter#query</code>.
+ */
+static VALUE
+counting_query(VALUE obj, VALUE str)
+{
+  struct counting *counting;
+  struct string_digest digest;
+
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+  counting_get_digest(counting, str, &digest);
+  if (counting_min(counting, &digest) == 0)
+    return Qfalse;
+
+  if (!NIL_P(counting->block))
+    call_handler(counting->block, str);
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   filter.count(item)    -> Number
+ *
+ * Get the smallest of the item's counters. This is at least the number of
+ * times the item was added and not deleted, and is more only because of
+ * collisions with other items. It is capped at the maximum counter value.
+ */
+static VALUE
+counting_count(VALUE obj, VALUE str)
+{
+  struct counting *counting;
+  struct string_digest digest;
+
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+  counting_get_digest(counting, str, &digest);
+  return UINT2NUM(counting_min(counting, &digest));
+}
+
+/*
+ * call-seq:
+ *   filter.handler       -> Proc or nil
+ *
+ * Get the handler Proc.
+ */
+static VALUE
+counting_handler(VALUE obj)
+{
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+
+  return counting->block;
+}
+
+/*
+ * call-seq:
+ *   filter.handler = proc or nil   -> proc or nil
+ *
+ * Set the handler Proc.
+ */
+static VALUE
+counting_set_handler(VALUE obj, VALUE handler)
+{
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+  rb_check_frozen(obj);
+
+  RB_OBJ_WRITE(obj, &counting->block, handler);
+  return handler;
+}
+
+/*
+ * call-seq:
+ *   filter.size      -> Number
+ *   filter.length    -> Number
+ *
+ * Get the length of the counter array in bytes.
+ */
+static VALUE
+counting_size(VALUE obj)
+{
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+
+  return SIZET2NUM(COUNTING_BYTES(counting));
+}
+
+/*
+ * call-seq:
+ *   filter.counter_count   -> Number
+ *
+ * Get the number of counters.
+ */
+static VALUE
+counting_counter_count(VALUE obj)
+{
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
 
-#define FILTER_SET_BIT(f, hash) do {     \
-  size_t _bit = hash % TOTAL_BITS(f);    \
-  CHUNK((f),_bit) |= BIT(_bit);          \
-} while (0)
+  return SIZET2NUM(counting->ncounters);
+}
 
-#ifdef __GNUC__
-#define FILTER_GET_BIT(f, hash) ({       \
-  size_t _bit = hash % TOTAL_BITS(f);    \
-  CHUNK((f),_bit) | BIT(_bit);           \
-})
-#else   /* __GNUC__ */
-#define FILTER_GET_BIT(f, hash) filter_get_bit(f, hash)
-static size_t
-filter_get_bit(struct filter *filter, size_t hash)
+/*
+ * call-seq:
+ *   filter.counter_bits    -> 4 or 8
+ *
+ * Get the width of each counter in bits.
+ */
+static VALUE
+counting_counter_bits(VALUE obj)
 {
-  size_t bit = hash % TOTAL_BITS(filter);
-  return CHUNK(filter, bit) | BIT(bit);
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+
+  return UINT2NUM(counting->width);
 }
-#endif  /* __GNUC__ */
 
-#define NULL_FILTER (struct filter *)0
+/*
+ * call-seq:
+ *   filter.hash_count   -> Number
+ *
+ * Get the number of counters touched per item.
+ */
+static VALUE
+counting_hash_count(VALUE obj)
+{
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
 
-#define FILTER_CHECK(f) do {                                   \
-  if ((f) && (f)->bitary == 0) {                               \
-    rb_raise(rb_eRuntimeError, "Uninitialized bloom filter");  \
-  }                                                            \
-} while (0)
+  return UINT2NUM(counting->nhashes);
+}
 
-#define FILTER_GET_STRING(f, str, cstr) do {    \
-  FILTER_CHECK(f);                              \
-  StringValue(str);                             \
-  cstr = RSTRING_PTR(str);                      \
-} while (0)
+/*
+ * call-seq:
+ *   filter.expected_fpr   -> Float
+ *
+ * Get the false positive rate expected once the filter holds as many items
+ * as its capacity.
+ */
+static VALUE
+counting_expected_fpr(VALUE obj)
+{
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
 
-static ID id_size;
-static ID id_each;
-static ID id_call;
+  return DBL2NUM(bloom_expected_fpr(BLOOM_LAYOUT_STANDARD, (double)counting->ncounters,
+                                    (double)counting->nhashes, (double)counting->capa));
+}
 
+/*
+ * call-seq:
+ *   filter.saturated    -> Number
+ *
+ * Get the number of counters stuck at their maximum value.
+ */
 static VALUE
-add_item(struct filter *filter, VALUE str)
+counting_saturated(VALUE obj)
 {
-  char *cstr;
-  size_t hash;
-
-  FILTER_GET_STRING(filter, str, cstr);
-  HASH_ITERATE(cstr, hash, {
-    FILTER_SET_BIT(filter, hash);
-  });
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
 
-  return str;
+  return SIZET2NUM(counting->saturated);
 }
 
-static void
-filter_mark(void *ptr)
+/*
+ * call-seq:
+ *   filter.overflows    -> Number
+ *
+ * Get the number of increments lost because the counter was saturated.
+ */
+static VALUE
+counting_overflows(VALUE obj)
 {
-  struct filter *filter = ptr;
-  rb_gc_mark(filter->block);
+  struct counting *counting;
+  TypedData_Get_Struct(obj, struct counting, &counting_type, counting);
+
+  return SIZET2NUM(counting->overflows);
 }
 
+/* Banks: many filters of one shape, stored bit-sliced (see struct bloom_bank)
+ * so that a key is hashed once and checked against every filter with k row
+ * reads, instead of k probes into each of thousands of filters.
+ */
+struct bank {
+  struct bloom_bank bank;
+  void *rowmem;
+  size_t capa;
+};
+
+#define BANK_CHECK(b) do {                                           \
+  if ((b)->bank.rows == 0) {                                         \
+    rb_raise(rb_eRuntimeError, "Uninitialized bloom filter bank");   \
+  }                                                                  \
+} while (0)
+
 static void
-filter_free(void *ptr)
+bank_free(void *ptr)
 {
-  struct filter *filter = ptr;
+  struct bank *bank = ptr;
 
-  if (filter->bitary) xfree(filter->bitary);
-  xfree(filter);
+  if (bank->rowmem) xfree(bank->rowmem);
+  xfree(bank);
 }
 
 static size_t
-filter_memsize(const void *ptr)
+bank_memsize(const void *ptr)
 {
-  const struct filter *filter = ptr;
-  size_t size = sizeof(struct filter);
+  const struct bank *bank = ptr;
+  size_t size = sizeof(struct bank);
 
-  if (filter->bitary) {
-    size += sizeof(size_t) * filter->arycapa;
+  if (bank->rowmem) {
+    size += sizeof(uint64_t) * (BLOOM_BANK_WORDS(&bank->bank) + BLOOM_WORDS_PER_BLOCK);
   }
 
   return size;
 }
 
-static const rb_data_type_t filter_type = {
-  "bloom_filter",
+static const rb_data_type_t bank_type = {
+  "bloom_filter/bank",
   {
-    filter_mark,
-    filter_free,
-    filter_memsize
+    0,
+    bank_free,
+    bank_memsize
   },
-  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | FILTER_TYPED_SHAREABLE
 };
 
 static VALUE
-filter_allocate(VALUE klass)
+bank_allocate(VALUE klass)
 {
-  struct filter *filter;
-  VALUE obj = TypedData_Make_Struct(klass, struct filter, &filter_type, filter);
+  struct bank *bank;
+  VALUE obj = TypedData_Make_Struct(klass, struct bank, &bank_type, bank);
 
-  filter->arycapa = 0;
-  filter->block   = Qnil;
-  filter->bitary  = 0;
+  bloom_init(&bank->bank.shape);
+  bank->bank.nslots = 0;
+  bank->bank.rowwords = 0;
+  bank->bank.rows = 0;
+  bank->rowmem = 0;
+  bank->capa = 0;
 
   return obj;
 }
 
-static VALUE
-init_i(RB_BLOCK_CALL_FUNC_ARGLIST(item, ptr))
+static size_t
+bank_get_slot(struct bank *bank, VALUE vslot)
 {
-  struct filter *filter = (struct filter *)ptr;
-  return add_item(filter, item);
+  long slot = NUM2LONG(vslot);
+
+  BANK_CHECK(bank);
+  if (slot < 0 || (size_t)slot >= bank->bank.nslots)
+    rb_raise(rb_eIndexError, "slot %ld outside of the bank's %"PRIuSIZE" slots",
+             slot, bank->bank.nslots);
+  return (size_t)slot;
 }
 
 /*
  * call-seq:
- *   BloomFilter.new(capa)                     -> filter
- *   BloomFilter.new(capa)  { |string| block } -> filter
- *   BloomFilter.new(array)                    -> filter
- *   BloomFilter.new(array) { |string| block } -> filter
- *   BloomFilter.new(enum)                     -> filter
- *   BloomFilter.new(enum)  { |string| block } -> filter
+ *   BloomFilter::Bank.new(slots, capa)                      -> bank
+ *   BloomFilter::Bank.new(slots, capa, fpr: 0.001)          -> bank
+ *   BloomFilter::Bank.new(slots, capa, layout: :blocked, hash: :wyhash, ...) -> bank
  *
- * Construct a new bloom filter.
+ * Construct a bank of <i>slots</i> empty filters, each sized for
+ * <i>capa</i> items. The <code>layout</code>, <code>fpr</code>,
+ * <code>bits_per_item</code>, <code>hashes</code>, <code>memory</code>,
+ * <code>reduction</code>, <code>hash</code> and <code>hash_key</code> options
+ * are as for <code>BloomFilter.new</code>, and describe each filter.
  *
- * The argument <i>capa</i> is the desired capacity. This doesn't have to be the
- * exact number of items to be stored in the set, but the more accurate this is,
- * the more optimal the resulting bloom array in terms of false positive rate
- * and memory usage.
+ * The filters are stored bit-sliced: bit <i>i</i> of every filter is kept
+ * in one row, so <code>query</code> hashes the key once and ANDs
+ * <code>hash_count</code> rows of <i>slots</i> bits. Each row is padded to
+ * a multiple of 256 slots for the vector loop that combines them, so the
+ * bank takes the memory of <i>slots</i> rounded up to a multiple of 256
+ * filters: a bank of 10 slots is as large as 256 separate filters. A slot
+ * must be updated a bit at a time, so <code>store</code> and
+ * <code>delete</code> touch every row.
+ */
+static VALUE
+bank_initialize(int argc, VALUE *argv, VALUE obj)
+{
+  struct bank *bank;
+  struct filter sizing;
+  size_t arycapa, nslots, rowwords;
+  VALUE slots, capa, opts, kwargs[8];
+  ID kwids[8];
+  int i;
+
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+  if (bank->bank.rows)
+    rb_raise(rb_eRuntimeError, "bloom filter bank already initialized");
+
+  rb_scan_args(argc, argv, "2:", &slots, &capa, &opts);
+  bank->capa = NUM2SIZET(capa);
+
+  bloom_init(&sizing.bloom);
+  for (i = 0; i < 8; ++i) kwargs[i] = Qundef;
+  if (!NIL_P(opts)) {
+    kwids[0] = id_layout;
+    kwids[1] = id_fpr;
+    kwids[2] = id_bits_per_item;
+    kwids[3] = id_hashes;
+    kwids[4] = id_memory;
+    kwids[5] = id_reduction;
+    kwids[6] = id_hash;
+    kwids[7] = id_hash_key;
+    rb_get_kwargs(opts, kwids, 0, 8, kwargs);
+    if (kwargs[0] != Qundef) sizing.bloom.layout = get_layout(kwargs[0]);
+    get_hash_options(kwargs[6], kwargs[7], &sizing.bloom.engine, sizing.bloom.hashkey);
+  }
+
+  arycapa = filter_sizing(&sizing, bank->capa, kwargs[1], kwargs[2], kwargs[3], kwargs[4],
+                          kwargs[5]);
+  if (NUM2LONG(slots) <= 0)
+    rb_raise(rb_eArgError, "slots must be positive");
+  nslots = NUM2SIZET(slots);
+  rowwords = BLOOM_BANK_ROW_WORDS(nslots);
+  if (rowwords == 0 || arycapa > SIZE_MAX / BLOOM_BITS_PER_WORD / sizeof(uint64_t) / rowwords - 1)
+    rb_raise(rb_eArgError, "bloom filter bank too large");
+
+  sizing.bloom.arycapa = arycapa;
+  bank->bank.shape = sizing.bloom;
+  bank->rowmem = xcalloc(BLOOM_TOTAL_BITS(&sizing.bloom) * rowwords + BLOOM_WORDS_PER_BLOCK,
+                         sizeof(uint64_t));
+  bank->bank.nslots = nslots;
+  bank->bank.rowwords = rowwords;
+  bank->bank.rows = BLOOM_ALIGN_BITS(bank->rowmem);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   bank.add(slot, item)   -> bank
  *
- * Instead of passing a capacity, an array can be passed in instead. In this case,
- * the array length is used as the capacity, and item in the array is added to the
- * filter.
+ * Add an item to the filter in a slot. The item may be a
+ * <code>BloomFilter::Digest</code> of the bank's hash engine.
+ */
+static VALUE
+bank_add(VALUE obj, VALUE vslot, VALUE item)
+{
+  struct bank *bank;
+  struct string_digest digest;
+  size_t slot;
+
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+  rb_check_frozen(obj);
+  slot = bank_get_slot(bank, vslot);
+  get_digest(item, bank->bank.shape.engine, bank->bank.shape.hashkey, &digest);
+  bloom_bank_add(&bank->bank, slot, &digest);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   bank.add_all(slot, array)   -> bank
+ *   bank.add_all(slot, enum)    -> bank
  *
- * If the argument is not an array or a fixnum, then it must respond to
- * <code>size</code> and <code>each</code>. The size method must return a fixnum,
- * and each item yielded by <code>each</code> will be aded to the filter.
+ * Add every item of an array, or of <code>to_a</code> of an enumerable, to
+ * the filter in a slot.
+ */
+static VALUE
+bank_add_all(VALUE obj, VALUE vslot, VALUE items)
+{
+  struct bank *bank;
+  struct string_digest digest;
+  size_t slot;
+  long i;
+
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+  rb_check_frozen(obj);
+  slot = bank_get_slot(bank, vslot);
+  items = rb_Array(items);
+  for (i = 0; i < RARRAY_LEN(items); ++i) {
+    get_digest(RARRAY_AREF(items, i), bank->bank.shape.engine, bank->bank.shape.hashkey,
+               &digest);
+    bloom_bank_add(&bank->bank, slot, &digest);
+  }
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   bank.query(item)                 -> Array
+ *   bank.query(item, bitmap: true)   -> String
  *
- * If a block is given, it will be called by <code>filter.query</code> when a
- * positive match is detected. The block can be set after initialization with
- * <code>filter.handler=</code>.
+ * Get the slots whose filters may contain an item, in ascending order. With
+ * <code>bitmap: true</code>, get them as a String of
+ * <code>(slot_count + 7) / 8</code> bytes instead, in which bit
+ * <code>i % 8</code> of byte <code>i / 8</code> is set when slot <i>i</i> is
+ * a candidate. The item may be a <code>BloomFilter::Digest</code> of the
+ * bank's hash engine.
+ *
+ *    bank.query(user_id).each { |tenant| ... }
  */
 static VALUE
-filter_initialize(VALUE obj, VALUE arg)
+bank_query(int argc, VALUE *argv, VALUE obj)
 {
-  size_t nitems, arycapa;
-  struct filter *filter;
-  VALUE *aryptr = 0, tmp;
-  int i, try_each = 0;
+  struct bank *bank;
+  struct string_digest digest;
+  uint64_t *slots, word;
+  size_t i, j, nbytes;
+  int bitmap = 0;
+  char *bytes;
+  VALUE item, opts, result, tmp, kwargs[1];
+  ID kwids[1];
 
-  switch (TYPE(arg)) {
-  case T_FIXNUM:
-    nitems = NUM2SIZET(arg);
-    break;
-  case T_ARRAY:
-    nitems = RARRAY_LEN(arg);
-    aryptr = RARRAY_PTR(arg);
-    break;
-  default:
-    try_each = 1;
-    tmp = rb_funcall(arg, id_size, 0, NULL);
-    if (!FIXNUM_P(tmp))
-      rb_raise(rb_eArgError, "Argument's size method returned an invalid size");
-    nitems = NUM2SIZET(tmp);
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+  BANK_CHECK(bank);
+  rb_scan_args(argc, argv, "1:", &item, &opts);
+  if (!NIL_P(opts)) {
+    kwids[0] = id_bitmap;
+    rb_get_kwargs(opts, kwids, 0, 1, kwargs);
+    bitmap = kwargs[0] != Qundef && RTEST(kwargs[0]);
   }
-  
-  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
 
-  /* nitems is the desired number of elements; we need to get the
-   * number of size_t needed to have one byte per item in the filter.
-   */
-  arycapa = GET_ARYCAPA(nitems);
-  filter->arycapa = arycapa;
-  if (arycapa > 0) filter->bitary = (size_t *)xcalloc(arycapa, sizeof(size_t));
-
-  /* deal with array arg and try_each cases */
-  if (aryptr) {
-    for (i = 0; i < nitems; ++i) {
-      add_item(filter, aryptr[i]);
+  get_digest(item, bank->bank.shape.engine, bank->bank.shape.hashkey, &digest);
+  slots = ALLOCV_N(uint64_t, tmp, bank->bank.rowwords + BLOOM_WORDS_PER_BLOCK);
+  slots = BLOOM_ALIGN_BITS(slots);
+  if (bitmap) {
+    bloom_bank_query(&bank->bank, &digest, slots);
+    nbytes = (bank->bank.nslots + 7) / 8;
+    result = rb_str_new(0, nbytes);
+    bytes = RSTRING_PTR(result);
+    for (i = 0; i < nbytes; ++i) {
+      bytes[i] = (char)(slots[i / 8] >> (8 * (i % 8)));
     }
   }
-  else if (try_each) {
-    rb_block_call(arg, id_each, 0, 0, init_i, (VALUE)filter);
+  else if (bloom_bank_query(&bank->bank, &digest, slots) == 0) {
+    result = rb_ary_new();
   }
-
-  /* store block */
-  if (rb_block_given_p()) {
-    RB_OBJ_WRITE(filter, &filter->block, rb_block_proc());
+  else {
+    result = rb_ary_new();
+    for (i = 0; i < bank->bank.rowwords; ++i) {
+      for (word = slots[i], j = 0; word; word >>= 1, ++j) {
+        if (word & 1) rb_ary_push(result, SIZET2NUM(i * BLOOM_BITS_PER_WORD + j));
+      }
+    }
   }
+  ALLOCV_END(tmp);
 
-  return obj;
+  return result;
 }
 
 /*
  * call-seq:
- *   filter.add(item)   -> filter
- *   filter << item     -> filter
+ *   bank.store(slot, filter)   -> bank
+ *   bank[slot] = filter
  *
- * Add an item to the filter. Note that any object added to the filter is coerced
- * into a string.
+ * Replace the filter in a slot with a copy of <i>filter</i>, which must have
+ * the bank's size, hash count, layout, reduction and hash engine, as
+ * <code>bank[slot]</code> does.
  */
 static VALUE
-filter_add_item(VALUE obj, VALUE item)
+bank_store(VALUE obj, VALUE vslot, VALUE arg)
 {
+  struct bank *bank;
   struct filter *filter;
-  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  size_t slot;
+
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+  TypedData_Get_Struct(arg, struct filter, &filter_type, filter);
+  rb_check_frozen(obj);
+  slot = bank_get_slot(bank, vslot);
+  FILTER_CHECK(filter);
+  check_same_shape(&bank->bank.shape, &filter->bloom);
+  bloom_bank_store(&bank->bank, slot, filter->bloom.bitary);
 
-  add_item(filter, item);
   return obj;
 }
 
+static VALUE
+bank_aset(VALUE obj, VALUE vslot, VALUE arg)
+{
+  bank_store(obj, vslot, arg);
+  return arg;
+}
+
 /*
  * call-seq:
- *   filter.include?(item)    -> Bool
- *   filter.query(item)       -> Bool
+ *   bank[slot]   -> filter
  *
- * Test an item to see it it's in the filter. If a positive match is reported
- * and the filter has a handler Proc, the proc will be called with the string
- * object as the argument.
+ * Get a copy of the filter in a slot, as a BloomFilter.
  */
 static VALUE
-filter_query_item(VALUE obj, VALUE str)
+bank_aref(VALUE obj, VALUE vslot)
 {
-  char *cstr;
+  struct bank *bank;
   struct filter *filter;
-  size_t hash;
+  size_t slot;
+  VALUE result;
 
-  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
-  FILTER_GET_STRING(filter, str, cstr);
-  HASH_ITERATE(cstr, hash, {
-    if (!FILTER_GET_BIT(filter, hash)) {
-      return Qfalse;
-    }
-  });
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+  slot = bank_get_slot(bank, vslot);
 
-  if (!NIL_P(filter->block))
-    rb_funcall(filter->block, id_call, 1, str);
-  return Qtrue;
+  result = filter_allocate(cBloomFilter);
+  TypedData_Get_Struct(result, struct filter, &filter_type, filter);
+  filter->capa = bank->capa;
+  filter->bloom.nhashes = bank->bank.shape.nhashes;
+  filter->bloom.layout = bank->bank.shape.layout;
+  filter->bloom.reduction = bank->bank.shape.reduction;
+  filter->bloom.engine = bank->bank.shape.engine;
+  memcpy(filter->bloom.hashkey, bank->bank.shape.hashkey, HASH_KEY_SIZE);
+  filter_alloc_bits(filter, bank->bank.shape.arycapa);
+  bloom_bank_load(&bank->bank, slot, filter->bloom.bitary);
+
+  return result;
 }
 
 /*
  * call-seq:
- *   filter.handler       -> Proc or nil
+ *   bank.delete(slot)   -> bank
  *
- * Get the handler Proc.
+ * Empty the filter in a slot, so that it is free for another.
  */
 static VALUE
-filter_handler(VALUE obj)
+bank_delete(VALUE obj, VALUE vslot)
 {
-  struct filter *filter;
-  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  struct bank *bank;
+  size_t slot;
 
-  return filter->block;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+  rb_check_frozen(obj);
+  slot = bank_get_slot(bank, vslot);
+  bloom_bank_clear(&bank->bank, slot);
+
+  return obj;
 }
 
 /*
  * call-seq:
- *   filter.handler = proc or nil   -> proc or nil
+ *   bank.slot_count   -> Number
  *
- * Set the handler Proc. Note that we don't do type or arity checks on the Proc,
- * so setting a bogus object as the handler will cause an error to get thrown
- * when a positive match is found.
+ * Get the number of filters the bank holds.
  */
 static VALUE
-filter_set_handler(VALUE obj, VALUE handler)
+bank_slot_count(VALUE obj)
 {
-  struct filter *filter;
-  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
 
-  RB_OBJ_WRITE(filter, &filter->block, handler);
-  return handler;
+  return SIZET2NUM(bank->bank.nslots);
 }
 
 /*
  * call-seq:
- *   filter.size      -> Number
- *   filter.length    -> Number
+ *   bank.capacity   -> Number
  *
- * Get the length of the underlying bit array in bytes.
+ * Get the number of items each filter was sized for.
  */
 static VALUE
-filter_size(VALUE obj)
+bank_capacity(VALUE obj)
 {
-  struct filter *filter;
-  TypedData_Get_Struct(obj, struct filter, &filter_type, filter);
-  return SIZET2NUM(filter->arycapa * sizeof(size_t));
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+
+  return SIZET2NUM(bank->capa);
 }
 
 /*
  * call-seq:
- *   BloomFilter.hash_values(str)   -> Array
+ *   bank.bit_count   -> Number
  *
- * For a given object, get an array containing the hash values returned by the
- * bloom filter's hash functions.
+ * Get the number of bits in each filter, which is the number of rows.
  */
 static VALUE
-filter_hash_values(VALUE klass, VALUE str)
+bank_bit_count(VALUE obj)
 {
-  char *cstr;
-  size_t hash;
-  VALUE ary = rb_ary_new();
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
 
-  FILTER_GET_STRING(NULL_FILTER, str, cstr);
-  HASH_ITERATE(cstr, hash, {
-    rb_ary_push(ary, SIZET2NUM(hash));
-  });
+  return ULL2NUM(BLOOM_TOTAL_BITS(&bank->bank.shape));
+}
 
-  return ary;
+/*
+ * call-seq:
+ *   bank.hash_count   -> Number
+ *
+ * Get the number of bits set for each item, and of rows read per query.
+ */
+static VALUE
+bank_hash_count(VALUE obj)
+{
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+
+  return UINT2NUM(bank->bank.shape.nhashes);
+}
+
+/*
+ * call-seq:
+ *   bank.layout   -> :standard or :blocked
+ *
+ * Get the bit layout of the bank's filters.
+ */
+static VALUE
+bank_layout(VALUE obj)
+{
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+
+  return layout_name(bank->bank.shape.layout);
+}
+
+/*
+ * call-seq:
+ *   bank.reduction   -> :mask or :fastrange
+ *
+ * Get how the bank's filters reduce hashes to bit indexes.
+ */
+static VALUE
+bank_reduction(VALUE obj)
+{
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+
+  return reduction_name(bank->bank.shape.reduction);
+}
+
+/*
+ * call-seq:
+ *   bank.hash_engine   -> :murmur3, :wyhash or :siphash
+ *
+ * Get the hash engine of the bank's filters.
+ */
+static VALUE
+bank_hash_engine(VALUE obj)
+{
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+
+  return engine_name(bank->bank.shape.engine);
+}
+
+/*
+ * call-seq:
+ *   bank.hash_key   -> String or nil
+ *
+ * Get the key of a keyed hash engine, for making filters and digests that
+ * the bank accepts.
+ */
+static VALUE
+bank_hash_key(VALUE obj)
+{
+  struct bank *bank;
+  TypedData_Get_Struct(obj, struct bank, &bank_type, bank);
+
+  if (!HASH_ENGINE_KEYED(bank->bank.shape.engine)) return Qnil;
+  return rb_str_new((const char *)bank->bank.shape.hashkey, HASH_KEY_SIZE);
 }
 
 /*
  * Document-class: BloomFilter
  *
- * This is a bloom filter implementation that uses string hashes. Any object can
- * be added to the bloom filter, but objects will be converted to strings before
- * being hashed.
+ * This is a bloom filter implementation that uses string hashes. Keys are
+ * hashed as bytes:
+ *
+ * - a String by its full byte length, so binary keys with embedded NUL bytes
+ *   are distinct from their prefixes;
+ * - an Integer in the signed 64-bit range by its 8-byte little-endian two's
+ *   complement (<code>[i].pack("q<")</code>), and a larger one by its
+ *   little-endian two's complement in one byte more than its magnitude needs;
+ * - a Symbol by its name, so <code>:a</code> and <code>"a"</code> are the
+ *   same key;
+ * - any other object by the String returned by its <code>to_str</code>.
+ *
+ * Integer and Symbol keys are hashed without allocating a String. These
+ * encodings are stable across platforms and versions, like the hash engines,
+ * so dumped filters keep answering for them. A key checked against many
+ * filters can be hashed once with <code>BloomFilter.digest</code>.
+ *
+ * By default, this bloom filter implementation uses a ratio of 8 bits per item
+ * stored in the set and 3 hash functions, yielding a 3% false positive rate. The
+ * size and number of hash functions can be chosen per filter from a target false
+ * positive rate, a number of bits per item or a memory budget. See
+ * <a href="http://corte.si/posts/code/bloom-filter-rules-of-thumb/">this page</a>.
  *
- * This bloom filter implementation uses a ratio of 8 bits per item stored in the
- * set, yielding a 2% false positive rate. For this ratio, the optimal number of
- * hash functions is 3. See <a href="http://corte.si/posts/code/bloom-filter-rules-of-thumb/">this page</a>.
+ * Each string is hashed once into a 128-bit digest (MurmurHash3 by default;
+ * see the <code>hash</code> option of <code>new</code>), and the probe
+ * positions are derived from the two halves of the digest (Kirsch-Mitzenmacher
+ * double hashing), so the string is only scanned once per add or query.
+ *
+ * With <code>layout: :blocked</code>, all the bits for a string are kept in
+ * one 64-byte block, trading a little accuracy for a single memory access
+ * per add or query.
  *
  * The desired capacity is passed to the initialization method. The filter cannot
- * be resized after initialization.
+ * be resized after initialization; BloomFilter::Scalable grows by adding slices
+ * when the number of items isn't known in advance. Items cannot be removed;
+ * BloomFilter::Counting supports deletion at four times the memory.
+ * BloomFilter::Bank stores many filters of one shape bit-sliced, to find
+ * which of thousands of them may contain a key in a single pass.
+ *
+ * A frozen filter can still be queried, but not added to or given a new
+ * handler. <code>Ractor.make_shareable(filter)</code> freezes the filter and
+ * its handler, which must then be a shareable Proc, and lets any number of
+ * Ractors query the same bit array in parallel without copying it.
  */
 void
 Init_filter_impl()
 {
-  VALUE cBloomFilter = rb_define_class("BloomFilter", rb_cData);
+#ifdef RB_EXT_RACTOR_SAFE
+  RB_EXT_RACTOR_SAFE(true);
+#endif
+
+  cBloomFilter = rb_define_class("BloomFilter", rb_cObject);
 
   rb_define_alloc_func(cBloomFilter, filter_allocate);
-  rb_define_method(cBloomFilter, "initialize", filter_initialize, 1);
+  rb_define_method(cBloomFilter, "initialize", filter_initialize, -1);
   rb_define_method(cBloomFilter, "handler", filter_handler, 0);
   rb_define_method(cBloomFilter, "handler=", filter_set_handler, 1);
   rb_define_method(cBloomFilter, "add", filter_add_item, 1);
   rb_define_alias(cBloomFilter, "<<", "add");
+  rb_define_method(cBloomFilter, "add_all", filter_add_all, 1);
   rb_define_method(cBloomFilter, "query", filter_query_item, 1);
   rb_define_alias(cBloomFilter, "include?", "query");
+  rb_define_method(cBloomFilter, "query_all", filter_query_all, -1);
+  rb_define_method(cBloomFilter, "select_present", filter_select_present, 1);
+  rb_define_method(cBloomFilter, "reject_present", filter_reject_present, 1);
   rb_define_method(cBloomFilter, "size", filter_size, 0);
   rb_define_alias(cBloomFilter, "length", "size");
-  rb_define_singleton_method(cBloomFilter, "hash_values", filter_hash_values, 1);
+  rb_define_method(cBloomFilter, "layout", filter_layout, 0);
+  rb_define_method(cBloomFilter, "reduction", filter_reduction, 0);
+  rb_define_method(cBloomFilter, "expected_fpr", filter_expected_fpr, 0);
+  rb_define_method(cBloomFilter, "bit_count", filter_bit_count, 0);
+  rb_define_method(cBloomFilter, "hash_count", filter_hash_count, 0);
+  rb_define_singleton_method(cBloomFilter, "hash_values", filter_hash_values, -1);
+  rb_define_singleton_method(cBloomFilter, "digest", filter_digest, -1);
+  rb_define_method(cBloomFilter, "dump", filter_dump, -1);
+  rb_define_method(cBloomFilter, "_dump", filter_marshal_dump, 1);
+  rb_define_singleton_method(cBloomFilter, "load", filter_s_load, 1);
+  rb_define_singleton_method(cBloomFilter, "_load", filter_marshal_load, 1);
+#ifdef HAVE_SYS_MMAN_H
+  rb_define_singleton_method(cBloomFilter, "open", filter_s_open, -1);
+  rb_define_method(cBloomFilter, "flush", filter_flush, 0);
+#endif
+  rb_define_method(cBloomFilter, "mapped_size", filter_mapped_size, 0);
+  rb_define_singleton_method(cBloomFilter, "nogvl_threshold", filter_nogvl_threshold, 0);
+  rb_define_singleton_method(cBloomFilter, "nogvl_threshold=", filter_set_nogvl_threshold, 1);
+  rb_define_method(cBloomFilter, "initialize_copy", filter_initialize_copy, 1);
+  rb_define_method(cBloomFilter, "merge!", filter_merge, -1);
+  rb_define_method(cBloomFilter, "intersect!", filter_intersect, -1);
+  rb_define_method(cBloomFilter, "|", filter_union, 1);
+  rb_define_method(cBloomFilter, "&", filter_and, 1);
+  rb_define_method(cBloomFilter, "bits_set", filter_bits_set_m, 0);
+  rb_define_method(cBloomFilter, "fill_ratio", filter_fill_ratio, 0);
+  rb_define_method(cBloomFilter, "estimated_count", filter_estimated_count_m, 0);
+  rb_define_method(cBloomFilter, "current_fpr", filter_current_fpr, 0);
+  rb_define_method(cBloomFilter, "measure_fpr", filter_measure_fpr, -1);
+  rb_define_method(cBloomFilter, "concurrent?", filter_concurrent_p, 0);
+  rb_define_method(cBloomFilter, "batch_handler?", filter_batch_handler_p, 0);
+  rb_define_method(cBloomFilter, "hash_engine", filter_hash_engine, 0);
+  rb_define_method(cBloomFilter, "hash_key", filter_hash_key, 0);
+  rb_define_method(cBloomFilter, "stats", filter_stats, 0);
+  rb_define_method(cBloomFilter, "reset_stats", filter_reset_stats, 0);
+
+  bloom_init_cpu();
+
+  cDigest = rb_define_class_under(cBloomFilter, "Digest", rb_cObject);
+  rb_undef_alloc_func(cDigest);
+  rb_define_method(cDigest, "hash_engine", digest_hash_engine, 0);
+  rb_define_method(cDigest, "==", digest_equal, 1);
+  rb_define_alias(cDigest, "eql?", "==");
+  rb_define_method(cDigest, "hash", digest_hash, 0);
+
+  cScalable = rb_define_class_under(cBloomFilter, "Scalable", rb_cObject);
+  rb_define_alloc_func(cScalable, scalable_allocate);
+  rb_define_method(cScalable, "initialize", scalable_initialize, -1);
+  rb_define_method(cScalable, "handler", scalable_handler, 0);
+  rb_define_method(cScalable, "handler=", scalable_set_handler, 1);
+  rb_define_method(cScalable, "add", scalable_add, 1);
+  rb_define_alias(cScalable, "<<", "add");
+  rb_define_method(cScalable, "add_all", scalable_add_all, 1);
+  rb_define_method(cScalable, "query", scalable_query, 1);
+  rb_define_alias(cScalable, "include?", "query");
+  rb_define_method(cScalable, "slices", scalable_slices, 0);
+  rb_define_method(cScalable, "slice_count", scalable_slice_count, 0);
+  rb_define_method(cScalable, "size", scalable_size, 0);
+  rb_define_alias(cScalable, "length", "size");
+  rb_define_method(cScalable, "capacity", scalable_capacity, 0);
+  rb_define_method(cScalable, "fpr", scalable_fpr, 0);
+  rb_define_method(cScalable, "expected_fpr", scalable_expected_fpr, 0);
+
+  cCounting = rb_define_class_under(cBloomFilter, "Counting", rb_cObject);
+  rb_define_alloc_func(cCounting, counting_allocate);
+  rb_define_method(cCounting, "initialize", counting_initialize, -1);
+  rb_define_method(cCounting, "handler", counting_handler, 0);
+  rb_define_method(cCounting, "handler=", counting_set_handler, 1);
+  rb_define_method(cCounting, "add", counting_add, 1);
+  rb_define_alias(cCounting, "<<", "add");
+  rb_define_method(cCounting, "add_all", counting_add_all, 1);
+  rb_define_method(cCounting, "delete", counting_delete, 1);
+  rb_define_method(cCounting, "query", counting_query, 1);
+  rb_define_alias(cCounting, "include?", "query");
+  rb_define_method(cCounting, "count", counting_count, 1);
+  rb_define_method(cCounting, "size", counting_size, 0);
+  rb_define_alias(cCounting, "length", "size");
+  rb_define_method(cCounting, "counter_count", counting_counter_count, 0);
+  rb_define_method(cCounting, "counter_bits", counting_counter_bits, 0);
+  rb_define_method(cCounting, "hash_count", counting_hash_count, 0);
+  rb_define_method(cCounting, "expected_fpr", counting_expected_fpr, 0);
+  rb_define_method(cCounting, "saturated", counting_saturated, 0);
+  rb_define_method(cCounting, "overflows", counting_overflows, 0);
+
+  cBank = rb_define_class_under(cBloomFilter, "Bank", rb_cObject);
+  rb_define_alloc_func(cBank, bank_allocate);
+  rb_define_method(cBank, "initialize", bank_initialize, -1);
+  rb_define_method(cBank, "add", bank_add, 2);
+  rb_define_method(cBank, "add_all", bank_add_all, 2);
+  rb_define_method(cBank, "query", bank_query, -1);
+  rb_define_method(cBank, "store", bank_store, 2);
+  rb_define_method(cBank, "[]=", bank_aset, 2);
+  rb_define_method(cBank, "[]", bank_aref, 1);
+  rb_define_method(cBank, "delete", bank_delete, 1);
+  rb_define_method(cBank, "slot_count", bank_slot_count, 0);
+  rb_define_method(cBank, "capacity", bank_capacity, 0);
+  rb_define_method(cBank, "bit_count", bank_bit_count, 0);
+  rb_define_method(cBank, "hash_count", bank_hash_count, 0);
+  rb_define_method(cBank, "layout", bank_layout, 0);
+  rb_define_method(cBank, "reduction", bank_reduction, 0);
+  rb_define_method(cBank, "hash_engine", bank_hash_engine, 0);
+  rb_define_method(cBank, "hash_key", bank_hash_key, 0);
 
   id_each = rb_intern("each");
   id_size = rb_intern("size");
   id_call = rb_intern("call");
+  id_layout = rb_intern("layout");
+  id_bitmap = rb_intern("bitmap");
+  id_fpr = rb_intern("fpr");
+  id_bits_per_item = rb_intern("bits_per_item");
+  id_hashes = rb_intern("hashes");
+  id_memory = rb_intern("memory");
+  id_standard = rb_intern("standard");
+  id_blocked = rb_intern("blocked");
+  id_reduction = rb_intern("reduction");
+  id_mask = rb_intern("mask");
+  id_fastrange = rb_intern("fastrange");
+  id_read = rb_intern("read");
+  id_write = rb_intern("write");
+  id_mode = rb_intern("mode");
+  id_readonly = rb_intern("readonly");
+  id_readwrite = rb_intern("readwrite");
+  id_advice = rb_intern("advice");
+  id_normal = rb_intern("normal");
+  id_random = rb_intern("random");
+  id_sequential = rb_intern("sequential");
+  id_willneed = rb_intern("willneed");
+  id_populate = rb_intern("populate");
+  id_verify = rb_intern("verify");
+  id_growth = rb_intern("growth");
+  id_tightening = rb_intern("tightening");
+  id_fill = rb_intern("fill");
+  id_counter_bits = rb_intern("counter_bits");
+  id_threads = rb_intern("threads");
+  id_track_fill = rb_intern("track_fill");
+  id_concurrent = rb_intern("concurrent");
+  id_hash = rb_intern("hash");
+  id_hash_key = rb_intern("hash_key");
+  id_murmur3 = rb_intern("murmur3");
+  id_wyhash = rb_intern("wyhash");
+  id_siphash = rb_intern("siphash");
+  id_urandom = rb_intern("urandom");
+  id_stats = rb_intern("stats");
+  id_adds = rb_intern("adds");
+  id_queries = rb_intern("queries");
+  id_positives = rb_intern("positives");
+  id_handler_calls = rb_intern("handler_calls");
+  id_batches = rb_intern("batches");
+  id_samples = rb_intern("samples");
+  id_seed = rb_intern("seed");
+  id_batch_handler = rb_intern("batch_handler");
+  id_current = rb_intern("current");
+  id_main = rb_intern("main");
 }
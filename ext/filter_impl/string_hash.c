@@ -1,54 +1,68 @@
 #include "string_hash.h"
-#include "ruby/st.h"
-#include "xxhash.h"
 
-/* hash 1: Use the hash function from the ruby hash table library (MurmurHash2) */
+/* All engines share the seed, and force h2 odd: a zero step would put every
+ * probe on the same bit.
+ */
+#define DIGEST_SEED 0x811c9dc5
 
-#define MURMUR_INIT (st_index_t)0x811c9dc5
-size_t
-murmur_hash(const char *str)
+/* murmur3: MurmurHash3 x64 128, the original engine */
+
+void MurmurHash3_x64_128(const void *key, size_t len, uint32_t seed, uint64_t out[2]);
+
+void
+murmur3_digest(const char *str, size_t len, const uint8_t *key, struct string_digest *digest)
 {
-  return (size_t)st_hash(str, strlen(str), MURMUR_INIT);
+  uint64_t out[2];
+
+  MurmurHash3_x64_128(str, len, DIGEST_SEED, out);
+  digest->h1 = out[0];
+  digest->h2 = out[1] | 1;
 }
 
-/* hash 2: Use siphash-2-4 with a hardcoded key (see https://github.com/veorq/SipHash) */
+/* wyhash: as fast as MurmurHash3 on keys of a few bytes, and several times
+ * faster on longer ones
+ */
 
-int siphash(uint8_t *out, const uint8_t *in, uint64_t inlen, const uint8_t *k);
-static uint8_t key[] = {
-  0x23, 0xbc, 0x00, 0x5f, 0x1a, 0xc2, 0xac, 0x11,
-  0x81, 0xff, 0xd9, 0x20, 0xda, 0x77, 0x8d, 0x3b
-};
+void wyhash_128(const void *key, size_t len, uint64_t seed, uint64_t out[2]);
 
-size_t
-siphash24(const char *str)
+void
+wyhash_digest(const char *str, size_t len, const uint8_t *key, struct string_digest *digest)
 {
-  size_t hash = 0, shift;
-  uint8_t out[8];
-  int i;
-
-  siphash(out, (uint8_t *)str, strlen(str), key);
-  for (i = 0, shift = 0; i < sizeof(size_t); i++, shift += 8) {
-    hash |= (size_t)out[i] << shift;
-  }
+  uint64_t out[2];
 
-  return hash;
+  wyhash_128(str, len, DIGEST_SEED, out);
+  digest->h1 = out[0];
+  digest->h2 = out[1] | 1;
 }
 
-/* hash 3: xxhash */
+/* siphash: SipHash-2-4 keyed with a secret, so that keys can't be chosen to
+ * collide without knowing it (see https://github.com/veorq/SipHash). The step
+ * is mixed from the 64-bit result, which is as hard to predict.
+ */
+
+int siphash(uint8_t *out, const uint8_t *in, uint64_t inlen, const uint8_t *k);
 
-size_t
-xxhash(const char *str)
+void
+siphash_digest(const char *str, size_t len, const uint8_t *key, struct string_digest *digest)
 {
-  if (sizeof(size_t) == 4) {
-    XXH32_hash_t hash;
-    unsigned int seed = 0x811c9dc5;
+  uint64_t hash = 0;
+  int i, shift;
+  uint8_t out[8];
 
-    return (size_t)XXH32(str, strlen(str), seed);
+  siphash(out, (const uint8_t *)str, len, key);
+  for (i = 0, shift = 0; i < 8; i++, shift += 8) {
+    hash |= (uint64_t)out[i] << shift;
   }
-  else {
-    XXH64_hash_t hash;
-    unsigned long long seed = 0x811c9dc5;
 
-    return (size_t)XXH64(str, strlen(str), seed);
-  }
+  digest->h1 = hash;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  digest->h2 = hash | 1;
 }
+
+const digest_func digest_funcs[HASH_ENGINE_COUNT] = {
+  murmur3_digest,
+  wyhash_digest,
+  siphash_digest
+};
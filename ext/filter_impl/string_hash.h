@@ -1,26 +1,68 @@
 #ifndef FILTER_BLOOM_STRING_HASH
 #define FILTER_BLOOM_STRING_HASH
 
+#include <stdint.h>
 #include <stdlib.h>
 
-typedef size_t (*hash_func)(const char *);
+/* A 128-bit digest of a key. Every probe position for the key is derived
+ * from these two words, so the key itself is only scanned once. Digest
+ * functions take the key's bytes and length, so keys may contain NUL bytes,
+ * and give the same digest on every platform, so that serialized filters can
+ * be shared between hosts.
+ */
+struct string_digest {
+  uint64_t h1;
+  uint64_t h2;
+};
 
-size_t murmur_hash(const char *);
-size_t siphash24(const char *);
-size_t xxhash(const char *);
+/* Hash engines, as recorded in serialized filters. Keyed engines take a
+ * HASH_KEY_SIZE byte key; the others ignore it.
+ */
+#define HASH_ENGINE_MURMUR3 0
+#define HASH_ENGINE_WYHASH  1
+#define HASH_ENGINE_SIPHASH 2
+#define HASH_ENGINE_COUNT   3
 
-static const hash_func hashes[] = {
-  murmur_hash,
-  siphash24,
-  xxhash,
-  0
-};
+#define HASH_KEY_SIZE 16
+#define HASH_ENGINE_KEYED(engine) ((engine) == HASH_ENGINE_SIPHASH)
+
+typedef void (*digest_func)(const char *, size_t, const uint8_t *, struct string_digest *);
+
+void murmur3_digest(const char *, size_t, const uint8_t *, struct string_digest *);
+void wyhash_digest(const char *, size_t, const uint8_t *, struct string_digest *);
+void siphash_digest(const char *, size_t, const uint8_t *, struct string_digest *);
+
+extern const digest_func digest_funcs[HASH_ENGINE_COUNT];
+
+/* The default engine */
+#define string_digest(str, len, digest) murmur3_digest((str), (len), 0, (digest))
+
+#define HASH_COUNT 3
+
+/* Kirsch-Mitzenmacher double hashing: the i-th probe is h1 + i * h2. Adding
+ * hash functions only adds an iteration of this loop, not another pass over
+ * the key.
+ */
+#define HASH_ITERATE(digest, count, hvar, block) do {       \
+  unsigned int _ind;                                       \
+  hvar = (digest)->h1;                                     \
+  for (_ind = 0; _ind < (count); ++_ind) {                 \
+    block                                                  \
+    hvar += (digest)->h2;                                  \
+  }                                                        \
+} while (0)
 
-#define HASH_ITERATE(str, hvar, block) do {                \
-  int _ind;                                                \
-  hash_func _func;                                         \
-  for (_ind = 0; (_func = hashes[_ind]) != 0; ++_ind) {    \
-    hvar = _func(str);                                     \
+/* Probes inside a single block of the blocked layout. h1 already picked the
+ * block, so these come from h2 alone: each step multiplies by the 64-bit
+ * golden ratio and the caller takes the top bits. An arithmetic sequence
+ * would repeat bits within a 512-bit block whenever the step is small.
+ */
+#define BLOCK_MULTIPLIER 0x9e3779b97f4a7c15ULL
+#define BLOCK_ITERATE(digest, count, hvar, block) do {      \
+  unsigned int _ind;                                       \
+  hvar = (digest)->h2;                                     \
+  for (_ind = 0; _ind < (count); ++_ind) {                 \
+    hvar *= BLOCK_MULTIPLIER;                              \
     block                                                  \
   }                                                        \
 } while (0)
@@ -0,0 +1,99 @@
+/*
+   wyhash 128-bit variant
+
+   wyhash was written by Wang Yi, and is released into the public domain
+   (The Unlicense).
+
+   This follows the final version 4 of wyhash from
+   https://github.com/wangyi-fudan/wyhash, reading the key in little-endian
+   order so the digest does not depend on the host's byte order. Where
+   wyhash folds its final 128-bit product into one word, both words of
+   the product are mixed again with different secrets, giving two 64-bit
+   halves for the cost of one extra multiply.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#define U8TO32_LE(p)                                                           \
+  (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) |                          \
+   ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24))
+
+#define U8TO64_LE(p) (U8TO32_LE(p) | (U8TO32_LE((p) + 4) << 32))
+
+static const uint64_t wyp[4] = {
+  0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+  0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+/* 64x64 -> 128-bit multiply: low half in *a, high half in *b */
+static void wymum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = (unsigned __int128)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  *a = lo;
+  *b = hi;
+#endif
+}
+
+static uint64_t wymix(uint64_t a, uint64_t b) {
+  wymum(&a, &b);
+  return a ^ b;
+}
+
+static uint64_t wyr3(const uint8_t *p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+void wyhash_128(const void *key, size_t len, uint64_t seed, uint64_t out[2]) {
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t a, b;
+  size_t i;
+
+  seed ^= wymix(seed ^ wyp[0], wyp[1]);
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (U8TO32_LE(p) << 32) | U8TO32_LE(p + ((len >> 3) << 2));
+      b = (U8TO32_LE(p + len - 4) << 32) | U8TO32_LE(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    i = len;
+    if (i >= 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(U8TO64_LE(p) ^ wyp[1], U8TO64_LE(p + 8) ^ seed);
+        see1 = wymix(U8TO64_LE(p + 16) ^ wyp[2], U8TO64_LE(p + 24) ^ see1);
+        see2 = wymix(U8TO64_LE(p + 32) ^ wyp[3], U8TO64_LE(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i >= 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(U8TO64_LE(p) ^ wyp[1], U8TO64_LE(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = U8TO64_LE(p + i - 16);
+    b = U8TO64_LE(p + i - 8);
+  }
+
+  a ^= wyp[1];
+  b ^= seed;
+  wymum(&a, &b);
+  out[0] = wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+  out[1] = wymix(a ^ wyp[2] ^ len, b ^ wyp[3]);
+}